@@ -0,0 +1,26 @@
+# Inserts the PARSER_PROFILE hooks declared in parser.y into the parser Bison
+# generated from it. Run as `cmake -DPARSER_C=<parser.tab.c> -P ProfileParser.cmake'.
+
+if (NOT PARSER_C)
+    message(FATAL_ERROR "PARSER_C must name the generated parser")
+endif()
+
+file(READ "${PARSER_C}" PARSER_SOURCE)
+
+function(add_hook _after _hook)
+    string(FIND "${PARSER_SOURCE}" "${_after}" _pos)
+    if (_pos EQUAL -1)
+        message(FATAL_ERROR "Can't find \"${_after}\" in ${PARSER_C}; has the Bison skeleton changed?")
+    endif()
+    string(REPLACE "${_after}" "${_after}  ${_hook}\n" _patched "${PARSER_SOURCE}")
+    set (PARSER_SOURCE "${_patched}" PARENT_SCOPE)
+endfunction()
+
+add_hook("  YY_SYMBOL_PRINT (\"Shifting\", yytoken, &yylval, &yylloc);\n"
+         "PARSER_PROFILE_SHIFT (yytoken);")
+add_hook("  YY_REDUCE_PRINT (yyn);\n"
+         "PARSER_PROFILE_REDUCE_BEGIN (yyn);")
+add_hook("  YY_SYMBOL_PRINT (\"-> $$ =\", YY_CAST (yysymbol_kind_t, yyr1[yyn]), &yyval, &yyloc);\n"
+         "PARSER_PROFILE_REDUCE_END (yyn);")
+
+file(WRITE "${PARSER_C}" "${PARSER_SOURCE}")
@@ -1,139 +1,879 @@
 #include "Common.h"
 
 #include "ast.h"
+#include "ast_events.h"
+#include "token_stream.h"
+#include "util/arena.h"
+#include "util/scan.h"
 P99_DEFINE_ENUM(ast_node_types);
 
 /*======================================================================================*/
 
-static int fp_wrap_free(struct fp_wrap_s *wrap) {
-        if (wrap->fp != stdin)
-                fclose(wrap->fp);
-        return 0;
-}
+static int input_free(struct ast_input *input);
+static bool input_from_fd(struct ast_input *input, int fd);
+static bool input_from_bstring(struct ast_input *input, bstring *str);
+static bool input_from_stream(struct ast_input *input);
+static bool input_normalize(struct ast_input *input);
+static bool input_normalize_span(struct ast_input *input, size_t off, size_t size, bool final);
+static void input_note_crlf(struct ast_input *input, size_t off);
+static void input_index_lines(struct ast_input *input);
+static void slice_strip_ws(const ast_data *data, ast_slice *slice);
+static ast_expr *expr_intern(ast_data *data, ast_expr *key);
+static ast_expr *expr_lookup(const ast_data *data, const ast_expr *key);
+static void      expr_insert(ast_data *data, ast_expr *expr);
+static unsigned  expr_operands(ast_expr *expr, ast_expr **ops[3]);
+static uint32_t  expr_slot(const struct ast_expr_table *tab, const ast_expr *expr);
+static void      join_exprs(ast_data *data, ast_data *part);
+static void      join_node_exprs(const struct ast_expr_table *tab, ast_expr *const *moved, ast_node *node);
+static uint32_t  expr_hash(const ast_data *data, const ast_expr *expr);
+static bool      expr_equal(const ast_data *data, const ast_expr *a, const ast_expr *b);
+static bool      slice_equal(const ast_data *data, ast_slice a, ast_slice b);
+static void      expr_table_grow(ast_data *data);
+static void      data_init_tree(ast_data *data);
+static int       data_free(ast_data *data);
+
+/* The arena of the last tree freed on this thread, kept for the next one. */
+static thread_local struct arena *spare_arena;
 
 ast_data *
 ast_data_create_(const void *src, const enum ast_data_types type)
 {
         ast_data *data = talloc_zero(NULL, ast_data);
-        data->fp_wrap  = talloc(data, struct fp_wrap_s);
-        talloc_set_destructor(data->fp_wrap, fp_wrap_free);
+        data->input    = talloc_zero(data, struct ast_input);
+        talloc_set_destructor(data->input, input_free);
+        bool ok        = false;
 
         switch (type) {
-        case COMPDATA_FILE:
-                data->fp_wrap->fp  = (FILE *)src;
+        case COMPDATA_FILE: {
+                FILE *fp = (FILE *)src;
+                ok       = input_from_fd(data->input, fileno(fp));
+                if (fp != stdin)
+                        fclose(fp);
                 break;
+        }
         case COMPDATA_FILENAME:
-                data->fp_wrap->fp  = fopen((const char *)src, "rb");
+        case COMPDATA_TOKEN_FILENAME: {
+                const int fd = open((const char *)src, O_RDONLY|O_BINARY);
+                if (fd == (-1))
+                        break;
+                ok = input_from_fd(data->input, fd);
+                close(fd);
+                break;
+        }
+        case COMPDATA_STRING:
+                ok = input_from_bstring(data->input, (bstring *)src);
+                break;
+        case COMPDATA_STREAM:
+                ok = input_from_stream(data->input);
                 break;
         default:
                 abort();
         }
 
-        if (!data->fp_wrap->fp) {
+        if (!ok) {
                 warn("Error: Null file");
                 talloc_free(data);
                 return NULL;
         }
+        if (type == COMPDATA_TOKEN_FILENAME ? !token_stream_attach(data)
+            : type != COMPDATA_STREAM && !input_normalize(data->input)) {
+                talloc_free(data);
+                return NULL;
+        }
 
-        data->cur             = ast_node_create(data, NODE_BLOCK);
-        data->cur->block.list = genlist_create(data->cur);
-        data->cur->depth      = 0;
-        data->top             = data->cur;
-        talloc_steal(data, data->cur);
+        data_init_tree(data);
         return data;
 }
 
+/*
+ * Creates an ast_data for parsing the part of `data's input ending at `len'
+ * on its own, such as on another thread. It has a tree and expressions of its
+ * own, and scans `buf', which is either the input's buffer or a copy of it,
+ * so offsets mean the same in both. Errors are counted but not reported.
+ */
+ast_data *
+ast_data_fork(const ast_data *data, uchar *buf, const size_t len)
+{
+        ast_data *part   = ast_data_borrow(buf, len);
+        part->quiet      = true;
+        part->input->bom = data->input->bom;
+        return part;
+}
+
+/*
+ * Creates an ast_data over `len' bytes at `buf' that are already normalized
+ * and followed by AST_INPUT_PAD NULs, such as the text of an AST image,
+ * without copying them. They must outlive the ast_data.
+ */
+ast_data *
+ast_data_borrow(uchar *buf, const size_t len)
+{
+        ast_data *data = talloc_zero(NULL, ast_data);
+        data->input    = talloc_zero(data, struct ast_input);
+
+        data->input->buf   = buf;
+        data->input->base  = buf;
+        data->input->len   = len;
+        data->input->avail = len;
+        data->input->kind  = INPUT_BORROWED;
+
+        data_init_tree(data);
+        return data;
+}
+
+/*
+ * Appends the top-level nodes of `part' to those of `data', then frees `part'.
+ * The part's expressions are interned again in `data', so that the joined
+ * tree shares identical expressions just like one parsed whole.
+ */
+void
+ast_data_join(ast_data *data, ast_data *part)
+{
+        ast_vec *list = &part->top->block.list;
+
+        arena_merge(data->arena, part->arena);
+        join_exprs(data, part);
+        for (unsigned i = 0; i < list->qty; ++i) {
+                ast_node *node = AST_VEC_AT(list, i);
+                node->parent   = data->top;
+                ast_vec_append(data, &data->top->block.list, node);
+        }
+        *list = (ast_vec){0};
+
+        data->nerrors += part->nerrors;
+        talloc_free(part);
+}
+
+/*
+ * Everything in the tree below the top block comes from an arena and is freed
+ * in one go along with it. Only the top block is an ordinary allocation, so it
+ * survives ast_data_release().
+ */
+static void
+data_init_tree(ast_data *data)
+{
+        ast_node *top = talloc_zero(data, ast_node);
+        top->parent   = top;
+        top->type     = NODE_BLOCK;
+        top->depth    = 0;
+
+        data->arena = (spare_arena) ? spare_arena : arena_create(0);
+        spare_arena = NULL;
+        data->top   = top;
+        data->cur   = top;
+        talloc_set_destructor(data, data_free);
+}
+
+static int
+data_free(ast_data *data)
+{
+        if (spare_arena) {
+                arena_destroy(data->arena);
+        } else {
+                arena_reset(data->arena);
+                spare_arena = data->arena;
+        }
+        return 0;
+}
+
+/*
+ * Whether the top-level nodes parsed so far are final. They are, except that
+ * a block standing on its own attaches to an unimplemented statement before
+ * it, blank lines aside, which then prints differently. After a syntax error
+ * it attaches to whatever is there.
+ */
+bool
+ast_data_settled(const ast_data *data)
+{
+        const ast_vec *list = &data->top->block.list;
+        unsigned       n    = list->qty;
+
+        while (n > 0 && ((const ast_node *)AST_VEC_AT(list, n - 1))->type == NODE_BLANK_LINE)
+                --n;
+        if (n == 0)
+                return true;
+
+        const ast_node *last = AST_VEC_AT(list, n - 1);
+        return last->block_parent || (last->type != NODE_ST_UNIMPL && last->type != NODE_ERROR);
+}
+
+/*
+ * Frees every top-level node and every expression parsed so far, once they
+ * have been written out. Must only be called between top-level statements,
+ * when nothing still on the parser's stack refers to them.
+ */
+void
+ast_data_release(ast_data *data)
+{
+        /* The list itself may have moved into the arena. */
+        data->top->block.list = (ast_vec){0};
+        data->exprs           = (struct ast_expr_table){0};
+        arena_reset(data->arena);
+}
+
 ast_node *
 ast_node_create(ast_data *data, enum ast_node_types type)
 {
-        ast_node *node = talloc_zero(data->cur, ast_node);
-        if (data->cur) {
-                node->parent = data->cur;
-                node->depth  = data->cur->depth + 1;
-                genlist_append(data->cur->block.list, node);
+        /* A statement is reported once whatever follows it has begun, by
+         * which time any line comment has been attached to it. A block only
+         * begins once it is known what it belongs to. */
+        if (data->pending && type != NODE_BLOCK)
+                ast_events_flush(data);
+
+        ast_node *node = arena_znew(data->arena, ast_node);
+        node->parent   = data->cur;
+        node->depth    = data->cur->depth + 1;
+        node->type     = type;
+        node->src      = data->loc;
+        ast_vec_append(data, &data->cur->block.list, node);
+        data->cur      = node;
+        return node;
+}
+
+/* Called with each node the parser closes, when events are being reported. */
+void
+ast_events_closed(ast_data *data, ast_node *node)
+{
+        if (node == data->top)
+                return;
+        if (node->type != NODE_BLOCK) {
+                data->pending = node;
+                return;
+        }
+
+        ast_events_flush(data);
+        if (data->events->block_end)
+                data->events->block_end(data, node, data->events_arg);
+}
+
+/* Reports the statement closed last, if it hasn't been yet. */
+void
+ast_events_flush(ast_data *data)
+{
+        ast_node *node = data->pending;
+
+        data->pending = NULL;
+        if (node && data->events->statement)
+                data->events->statement(data, node, data->events_arg);
+}
+
+void
+ast_vec_append(ast_data *data, ast_vec *vec, void *item)
+{
+        const uint32_t max = (vec->max) ? vec->max : AST_VEC_INLINE;
+
+        if (vec->qty == max) {
+                void **lst = arena_alloc(data->arena, 2 * max * sizeof(void *));
+                memcpy(lst, AST_VEC_ITEMS(vec), max * sizeof(void *));
+                vec->lst = lst;
+                vec->max = 2 * max;
+        }
+        AST_VEC_ITEMS(vec)[vec->qty++] = item;
+}
+
+/*
+ * Copy the text of a slice into a new string, for values that have to be
+ * modified or that must outlive the input buffer.
+ */
+bstring *
+ast_slice_dup(const ast_data *data, const ast_slice slice)
+{
+        return b_fromblk(AST_SLICE_PTR(data, slice), slice.len);
+}
+
+/*
+ * Names that recur throughout a file (statement ids, attribute names, variables
+ * and identifiers) are interned, so every occurrence shares one string no matter
+ * which file or thread it came from.
+ */
+const interned_string *
+ast_slice_intern(const ast_data *data, const ast_slice slice)
+{
+        return intern_blk(AST_SLICE_PTR(data, slice), slice.len);
+}
+
+static void
+slice_strip_ws(const ast_data *data, ast_slice *slice)
+{
+        const uchar *str = AST_SLICE_PTR(data, *slice);
+        uint32_t     beg = 0;
+        uint32_t     end = slice->len;
+
+        while (beg < end && isspace(str[beg]))
+                ++beg;
+        while (end > beg && isspace(str[end - 1]))
+                --end;
+
+        slice->off += beg;
+        slice->len  = end - beg;
+}
+
+/*======================================================================================*/
+
+static int
+input_free(struct ast_input *input)
+{
+        switch (input->kind) {
+        case INPUT_MAPPED:   unmap_file(input->base, input->maplen); break;
+        case INPUT_HEAP:
+        case INPUT_STREAM:   xfree(input->base);                     break;
+        case INPUT_BORROWED: break;
+        }
+        return 0;
+}
+
+/*
+ * Regular files are mapped directly. Only a descriptor that is still at offset
+ * zero can be mapped, since anything before the current position has already
+ * been consumed by someone else. Everything else is read into memory.
+ */
+static bool
+input_from_fd(struct ast_input *input, const int fd)
+{
+        if (lseek(fd, 0, SEEK_CUR) == 0) {
+                input->buf = map_file_padded(fd, AST_INPUT_PAD, &input->len, &input->maplen);
+                if (input->buf) {
+                        input->base = input->buf;
+                        input->kind = INPUT_MAPPED;
+                        return true;
+                }
+        }
+
+        input->buf  = read_fd_padded(fd, AST_INPUT_PAD, &input->len);
+        input->base = input->buf;
+        input->kind = INPUT_HEAP;
+        return input->buf != NULL;
+}
+
+/*
+ * The string is scanned in place, so it must outlive the ast_data and must not
+ * be modified while it is in use. It only needs to grow if there is no room
+ * for the second trailing NUL. It is copied instead if it is write protected,
+ * or if it has carriage returns that normalizing would remove.
+ */
+static bool
+input_from_bstring(struct ast_input *input, bstring *str)
+{
+        if (!str || !str->data)
+                return false;
+
+        const bool has_cr = scan_find(str->data, str->data + str->slen, '\r') != NULL;
+
+        if (!has_cr && (str->mlen >= str->slen + AST_INPUT_PAD || b_alloc(str, str->slen + AST_INPUT_PAD) != BSTR_ERR)) {
+                str->data[str->slen]     = '\0';
+                str->data[str->slen + 1] = '\0';
+                input->buf               = str->data;
+                input->len               = str->slen;
+                input->kind              = INPUT_BORROWED;
         } else {
-                node->parent = node;
+                input->buf  = xmalloc(str->slen + AST_INPUT_PAD);
+                input->len  = str->slen;
+                input->kind = INPUT_HEAP;
+                memcpy(input->buf, str->data, str->slen);
+                memset(input->buf + str->slen, 0, AST_INPUT_PAD);
         }
-        node->type = type;
-        data->cur  = node;
-        return node;
+
+        input->base = input->buf;
+        return true;
+}
+
+/* Stream buffers start out with this much room and double as needed. */
+#define STREAM_INITIAL_SIZE 16384
+
+static bool
+input_from_stream(struct ast_input *input)
+{
+        input->maplen = STREAM_INITIAL_SIZE;
+        input->base   = xcalloc(input->maplen, 1);
+        input->buf    = input->base;
+        input->kind   = INPUT_STREAM;
+        return true;
+}
+
+static bool
+input_normalize(struct ast_input *input)
+{
+        if (input->len >= 3 && memcmp(input->buf, "\xEF\xBB\xBF", 3) == 0) {
+                input->buf += 3;
+                input->len -= 3;
+                input->bom  = true;
+        }
+
+        if (!input_normalize_span(input, 0, input->len, true))
+                return false;
+        input->len = input->avail;
+        memset(input->buf + input->len, 0, AST_INPUT_PAD);
+        return true;
+}
+
+/*
+ * Appends a chunk to a stream input and normalizes as much of it as can be.
+ * The line index, if one was built, is dropped since it no longer covers the
+ * whole input. With `final' set nothing more will follow, so nothing is held
+ * back. Returns false if the input is not valid UTF-8.
+ */
+bool
+ast_input_append(struct ast_input *input, const void *chunk, const size_t size, const bool final)
+{
+        const size_t skip = input->buf - input->base;
+        const size_t need = skip + input->avail + input->raw + size + AST_INPUT_PAD;
+
+        if (need > input->maplen) {
+                input->maplen = MAX(need, input->maplen * 2);
+                input->base   = xrealloc(input->base, input->maplen);
+                input->buf    = input->base + skip;
+        }
+        if (size > 0)
+                memcpy(input->buf + input->avail + input->raw, chunk, size);
+
+        size_t pending = input->raw + size;
+
+        /* A byte order mark can only come first, and may itself arrive in pieces. */
+        if (input->avail == 0 && !input->bom) {
+                if (pending < 3 && !final && memcmp(input->buf, "\xEF\xBB\xBF", pending) == 0) {
+                        input->raw = pending;
+                        return true;
+                }
+                if (pending >= 3 && memcmp(input->buf, "\xEF\xBB\xBF", 3) == 0) {
+                        input->buf += 3;
+                        input->bom  = true;
+                        pending    -= 3;
+                }
+        }
+
+        return input_normalize_span(input, input->avail, pending, final);
+}
+
+/*
+ * One pass over `size' bytes starting at `off' that validates them as UTF-8
+ * and drops the CR of every CRLF pair, moving the text down over any removed
+ * CRs. ASCII other than CR is passed over a vector at a time; only non-ASCII
+ * sequences and CRs are looked at one by one. Nothing is moved unless a CR
+ * has actually been removed, so the usual LF-only file is only ever read.
+ *
+ * Unless `final' is set, a CR or an incomplete sequence at the very end is
+ * left for the next call. On return `avail' is the end of the normalized text
+ * and `raw' the number of bytes left over after it.
+ */
+static bool
+input_normalize_span(struct ast_input *input, const size_t off, const size_t size, const bool final)
+{
+        uchar *const   buf     = input->buf;
+        const uchar   *end     = buf + off + size;
+        const uchar   *r       = buf + off;
+        uchar         *w       = buf + off;
+        const uint32_t removed = input->ncrlf;
+
+        for (;;) {
+                const uchar *q = scan_find_special(r, end, '\r');
+                if (w != r)
+                        memmove(w, r, q - r);
+                w += q - r;
+                r  = q;
+                if (r == end)
+                        break;
+
+                if (*r == '\r') {
+                        if (r + 1 == end && !final)
+                                break;
+                        if (r + 1 < end && r[1] == '\n')
+                                input_note_crlf(input, w - buf);
+                        else
+                                *w++ = '\r';
+                        ++r;
+                } else {
+                        const unsigned n = scan_utf8_sequence(r, end);
+                        if (n == 0) {
+                                if (!final && end - r < 4)
+                                        break;
+                                /* Only CRs have been removed before `w', so the newlines still count the lines. */
+                                warnx("Error: Invalid UTF-8 at byte %zu (line %zu)",
+                                      (size_t)(r - buf) + removed + (input->bom ? 3 : 0),
+                                      scan_count(buf, w, '\n') + 1);
+                                return false;
+                        }
+                        memmove(w, r, n);
+                        w += n;
+                        r += n;
+                }
+        }
+
+        if (w != r)
+                memmove(w, r, end - r);
+        input->avail = w - buf;
+        input->raw   = end - r;
+        return true;
+}
+
+static void
+input_note_crlf(struct ast_input *input, const size_t off)
+{
+        const size_t max = talloc_array_length(input->crlf);
+        if (input->ncrlf >= max)
+                input->crlf = talloc_realloc(input, input->crlf, uint32_t, (max) ? max * 2 : 64);
+        input->crlf[input->ncrlf++] = (uint32_t)off;
+}
+
+/* Maps an offset in the normalized buffer back to one in the original input. */
+size_t
+ast_input_source_offset(const struct ast_input *input, const size_t off)
+{
+        uint32_t lo = 0;
+        uint32_t hi = input->ncrlf;
+
+        while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (input->crlf[mid] <= off)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return off + lo + (input->bom ? 3 : 0);
+}
+
+/*
+ * Finds the line and column of an offset into the input. The line index is
+ * built the first time this is called, which only happens when there's an
+ * error to report or a source map to write, so other runs never pay for it.
+ * Input appended since the last call is indexed then, not all of it again.
+ */
+struct ast_position
+ast_input_locate(struct ast_input *input, size_t off)
+{
+        if (off > input->len)
+                off = input->len;
+        if (!input->lines || input->indexed < input->len)
+                input_index_lines(input);
+
+        uint32_t lo = 1;
+        uint32_t hi = input->nlines;
+        while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (input->lines[mid] <= off)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        const uint32_t  start = input->lines[lo - 1];
+        const uint32_t  next  = (lo < input->nlines) ? input->lines[lo] - 1 : (uint32_t)input->len;
+        const uchar    *str   = input->buf + start;
+        uint32_t        col   = 1;
+
+        for (uint32_t i = 0; i < off - start; ++i)
+                col += ((str[i] & 0xC0) != 0x80);
+
+        return (struct ast_position){lo, col, start, next - start};
+}
+
+/* Adds the lines of the input past `indexed' to the index. */
+static void
+input_index_lines(struct ast_input *input)
+{
+        const uchar *const buf  = input->buf;
+        const uchar *const end  = buf + input->len;
+        const uchar       *p    = buf + input->indexed;
+        const size_t       need = input->nlines + scan_count(p, end, '\n') + 1;
+        const size_t       max  = talloc_array_length(input->lines);
+
+        if (need > max)
+                input->lines = talloc_realloc(input, input->lines, uint32_t, MAX(need, max * 2));
+        if (input->nlines == 0)
+                input->lines[input->nlines++] = 0;
+
+        while ((p = scan_find(p, end, '\n')))
+                input->lines[input->nlines++] = (uint32_t)(++p - buf);
+        input->indexed = input->len;
+}
+
+/*======================================================================================*/
+/* Expressions */
+
+#define EXPR_TABLE_MIN 256
+
+#define HASH_PTR(HASH, PTR)   ((HASH) = hash_step((HASH), (uintptr_t)(PTR)))
+#define HASH_EXPR(HASH, EXPR) ((HASH) = hash_step((HASH), (EXPR) ? (EXPR)->hash : 0))
+
+/* Mixes one more word into a hash. */
+static inline uint32_t
+hash_step(uint32_t hash, const uint64_t val)
+{
+        hash = (hash ^ (uint32_t)val ^ (uint32_t)(val >> 32)) * UINT32_C(0x9E3779B1);
+        return hash ^ (hash >> 15);
+}
+
+/*
+ * Returns the expression of the tree identical to `key', copying `key' into
+ * the tree's arena first if there isn't one. Operands are already unique, so
+ * only their addresses need comparing; operators are string constants, which
+ * are unique by address as well.
+ */
+static ast_expr *
+expr_intern(ast_data *data, ast_expr *key)
+{
+        key->hash = expr_hash(data, key);
+
+        ast_expr *expr = expr_lookup(data, key);
+        if (!expr) {
+                expr  = arena_new(data->arena, ast_expr);
+                *expr = *key;
+                expr_insert(data, expr);
+        }
+        return expr;
+}
+
+/*
+ * Operators are string constants of a few characters. Their lengths are kept
+ * in the expression so that rendering it never has to measure them.
+ */
+#define CSTR_LEN(STR) ((STR) ? (uint8_t)strlen(STR) : 0)
+
+ast_expr *
+ast_expr_text(ast_data *data, const ast_slice text)
+{
+        ast_expr key = {.type = EXPR_TEXT, .text = text};
+        return expr_intern(data, &key);
+}
+
+/* A variable or other name. It is interned, so equal names share one expression in every tree. */
+ast_expr *
+ast_expr_name(ast_data *data, const ast_slice text)
+{
+        ast_expr key = {.type = EXPR_TEXT, .text = text, .name = ast_slice_intern(data, text)};
+        return expr_intern(data, &key);
+}
+
+/* Used for every kind with two operands; `op' only matters for EXPR_BINARY. */
+ast_expr *
+ast_expr_binary(ast_data *data, const enum ast_expr_type type, ast_expr *lhs, const char *op, ast_expr *rhs)
+{
+        ast_expr key = {.type = type, .op_len = CSTR_LEN(op), .binary = {lhs, rhs, op}};
+        return expr_intern(data, &key);
+}
+
+ast_expr *
+ast_expr_unary(ast_data *data, const enum ast_expr_type type, const char *op, ast_expr *operand)
+{
+        ast_expr key = {.type = type, .op_len = CSTR_LEN(op), .unary = {operand, op}};
+        return expr_intern(data, &key);
+}
+
+ast_expr *
+ast_expr_group(ast_data *data, const char *open, ast_expr *inner, const char *close)
+{
+        ast_expr key = {
+                .type      = EXPR_GROUP,
+                .op_len    = CSTR_LEN(open),
+                .close_len = CSTR_LEN(close),
+                .group     = {inner, open, close},
+        };
+        return expr_intern(data, &key);
+}
+
+ast_expr *
+ast_expr_call(ast_data *data, const ast_slice fn, ast_expr *arg)
+{
+        ast_expr key = {.type = EXPR_CALL, .call = {fn, arg}};
+        return expr_intern(data, &key);
+}
+
+ast_expr *
+ast_expr_conditional(ast_data *data, ast_expr *cond, ast_expr *yes, ast_expr *no)
+{
+        ast_expr key = {.type = EXPR_CONDITIONAL, .conditional = {cond, yes, no}};
+        return expr_intern(data, &key);
+}
+
+#undef CSTR_LEN
+
+/*
+ * Appends the text of an expression to `out'. An explicit stack is used rather
+ * than recursion because left associative chains, such as a long run of "and"
+ * conditions, are as deep as they are long. Each entry is either an expression
+ * or a bit of punctuation. Every part is appended exactly once, so this is
+ * linear in the length of the result.
+ */
+void
+ast_expr_render(const ast_data *data, const ast_expr *expr, bstring *out)
+{
+        struct render_item {
+                const ast_expr *expr;
+                const char     *str;
+                uint32_t        len;
+                bool            spaced; /* A binary operator, with a space either side */
+        };
+        struct render_item  local[64];
+        struct render_item *stack = local;
+        size_t              max   = ARRSIZ(local);
+        size_t              n     = 0;
+        char                opbuf[16];
+
+#define PUSH(EXPR)         (stack[n++] = (struct render_item){(EXPR), NULL, 0, false})
+#define PUSH_STR(STR, LEN) (stack[n++] = (struct render_item){NULL, (STR), (LEN), false})
+#define PUSH_LIT(LIT)      (stack[n++] = (struct render_item){NULL, ("" LIT), sizeof(LIT) - 1, false})
+#define PUSH_OP(OP, LEN)   (stack[n++] = (struct render_item){NULL, (OP), (LEN), true})
+
+        PUSH(expr);
+
+        while (n > 0) {
+                const struct render_item item = stack[--n];
+                if (!item.expr) {
+                        if (item.spaced && item.len < sizeof(opbuf) - 2) {
+                                opbuf[0] = ' ';
+                                memcpy(opbuf + 1, item.str, item.len);
+                                opbuf[item.len + 1] = ' ';
+                                b_catblk(out, opbuf, item.len + 2);
+                        } else if (item.spaced) {
+                                b_catchar(out, ' ');
+                                b_catblk(out, item.str, item.len);
+                                b_catchar(out, ' ');
+                        } else if (item.len > 0) {
+                                b_catblk(out, item.str, item.len);
+                        }
+                        continue;
+                }
+
+                /* No case pushes more than five entries. */
+                if (n + 5 > max) {
+                        max  *= 2;
+                        stack = (stack == local) ? memcpy(nmalloc(max, sizeof *stack), local, sizeof local)
+                                                 : nrealloc(stack, max, sizeof *stack);
+                }
+
+                expr = item.expr;
+                switch (expr->type) {
+                case EXPR_TEXT:
+                        b_catblk(out, AST_SLICE_PTR(data, expr->text), expr->text.len);
+                        break;
+                case EXPR_BINARY:
+                        PUSH(expr->binary.rhs);
+                        PUSH_OP(expr->binary.op, expr->op_len);
+                        PUSH(expr->binary.lhs);
+                        break;
+                case EXPR_MEMBER:
+                        PUSH(expr->binary.rhs);
+                        PUSH_LIT(".");
+                        PUSH(expr->binary.lhs);
+                        break;
+                case EXPR_LIST:
+                        PUSH(expr->binary.rhs);
+                        PUSH_LIT(", ");
+                        PUSH(expr->binary.lhs);
+                        break;
+                case EXPR_FIELD:
+                        PUSH_LIT("\"");
+                        PUSH(expr->binary.rhs);
+                        PUSH_LIT("=\"");
+                        PUSH(expr->binary.lhs);
+                        break;
+                case EXPR_FIELDS:
+                        PUSH(expr->binary.rhs);
+                        PUSH_LIT(" ");
+                        PUSH(expr->binary.lhs);
+                        break;
+                case EXPR_UNARY:
+                        PUSH(expr->unary.operand);
+                        PUSH_STR(expr->unary.op, expr->op_len);
+                        break;
+                case EXPR_POSTFIX:
+                        PUSH_STR(expr->unary.op, expr->op_len);
+                        PUSH(expr->unary.operand);
+                        break;
+                case EXPR_GROUP:
+                        PUSH_STR(expr->group.close, expr->close_len);
+                        PUSH(expr->group.inner);
+                        PUSH_STR(expr->group.open, expr->op_len);
+                        break;
+                case EXPR_CALL:
+                        b_catblk(out, AST_SLICE_PTR(data, expr->call.fn), expr->call.fn.len);
+                        PUSH_LIT(")");
+                        PUSH(expr->call.arg);
+                        PUSH_LIT("(");
+                        break;
+                case EXPR_CONDITIONAL:
+                        b_catlit(out, "if (");
+                        PUSH(expr->conditional.no);
+                        PUSH_LIT(" else ");
+                        PUSH(expr->conditional.yes);
+                        PUSH_LIT(") then ");
+                        PUSH(expr->conditional.cond);
+                        break;
+                default:
+                        warnx("Unknown expression type: %d", expr->type);
+                        abort();
+                }
+        }
+
+#undef PUSH
+#undef PUSH_LIT
+#undef PUSH_OP
+#undef PUSH_STR
+        if (stack != local)
+                free(stack);
 }
 
 /*======================================================================================*/
 
 void
-new_unimpl_statement(ast_data *data, bstring *id)
+new_unimpl_statement(ast_data *data, const ast_slice id)
 {
         ast_node *node    = ast_node_create(data, NODE_ST_UNIMPL);
-        node->unimpl.id   = id;
-        node->unimpl.list = genlist_create(node);
-        talloc_steal(node, node->unimpl.id);
+        node->unimpl.id   = ast_slice_intern(data, id);
 }
 
 void
-new_unimpl_subexpr(ast_data *data, bstring *id, bstring *statement)
+new_unimpl_subexpr(ast_data *data, const ast_slice id, const ast_slice statement)
 {
-        ast_atom *atom    = talloc(data->cur->unimpl.list, ast_atom);
+        ast_atom *atom    = arena_new(data->arena, ast_atom);
         atom->type        = AT_UNIMPL_ARG;
-        atom->unimpl.id   = id;
+        atom->unimpl.id   = ast_slice_intern(data, id);
         atom->unimpl.text = statement;
-        talloc_steal(atom, id);
-        talloc_steal(atom, statement);
-        genlist_append(data->cur->unimpl.list, atom);
+        ast_vec_append(data, &data->cur->unimpl.list, atom);
 }
 
 /*======================================================================================*/
 
 void
-new_assignment_statement(ast_data *data, bstring *var, bstring *expr, enum ast_assignment_type type)
+new_assignment_statement(ast_data *data, ast_expr *var, ast_expr *expr, enum ast_assignment_type type)
 {
-        ast_node *node           = ast_node_create(data, NODE_ST_ASSIGN);
-        node->assignment.var     = var;
-        node->assignment.type    = type;
-        talloc_steal(node, node->assignment.var);
-        if (expr) {
-                node->assignment.expr = expr;
-                talloc_steal(node, node->assignment.expr);
-        }
+        ast_node *node        = ast_node_create(data, NODE_ST_ASSIGN);
+        node->assignment.var  = var;
+        node->assignment.type = type;
+        node->assignment.expr = expr;
 }
 
 void
-new_conditional_statement(ast_data *data, bstring *expr, int type)
+new_conditional_statement(ast_data *data, ast_expr *expr, int type)
 {
         ast_node *node  = ast_node_create(data, 0);
         node->type      = type;
         node->condition = expr;
-        talloc_steal(node, node->condition);
 }
 
 void
-new_for_statement(ast_data *data, bstring *var, bstring *ident, int reversed)
+new_for_statement(ast_data *data, ast_expr *var, ast_expr *ident, int reversed)
 {
         ast_node *node         = ast_node_create(data, NODE_ST_FOR);
         node->forstmt.var      = var;
         node->forstmt.ident    = ident;
         node->forstmt.reversed = reversed;
-        talloc_steal(node, node->forstmt.var);
-        talloc_steal(node, node->forstmt.ident);
 }
 
 /*======================================================================================*/
 
 void
-new_simple_statement(ast_data *data, bstring *keyword, int type)
+new_simple_statement(ast_data *data, int type)
 {
         ast_node *node = ast_node_create(data, 0);
         node->type     = type;
-        node->keyword  = keyword;
-        talloc_steal(node, node->keyword);
 }
 
 void
-new_undef_statement(ast_data *data, bstring *var)
+new_undef_statement(ast_data *data, ast_expr *var)
 {
         ast_node *node = ast_node_create(data, NODE_ST_UNDEF);
         node->string   = var;
-        talloc_steal(node, node->string);
 }
 
 /*======================================================================================*/
@@ -141,38 +881,57 @@ new_undef_statement(ast_data *data, bstring *var)
 void
 new_block(ast_data *data)
 {
-        /* eprintf("The parent node is presently of type %s\n", ast_node_types_getname(data->cur->type)); */
         ast_node *node     = ast_node_create(data, NODE_BLOCK);
-        node->block.list   = genlist_create(node);
-        unsigned  pnum     = node->parent->block.list->qty - 2;
-        ast_node *prev     = node->parent->block.list->lst[pnum];
+        ast_vec  *siblings = &node->parent->block.list;
+        unsigned  pnum     = siblings->qty - 1;
+        ast_node *prev     = NULL;
+
+        /* Blank lines in between don't count. When streaming, whatever came
+         * before may also already have been written out and released. */
+        while (pnum-- > 0 && (prev = AST_VEC_AT(siblings, pnum))->type == NODE_BLANK_LINE)
+                prev = NULL;
+        if (!prev) {
+                if (!data->nerrors) {
+                        warnx("Invalid block node: nothing precedes it");
+                        abort();
+                }
+                node->block.opener = NODE_ERROR;
+                goto out;
+        }
 
-retry:
         switch (prev->type) {
-        case NODE_BLANK_LINE: prev = node->parent->block.list->lst[--pnum]; goto retry;
-        case NODE_ST_UNIMPL: node->block.name = prev->unimpl.id;        break;
-        case NODE_ST_IF:     node->block.name = b_fromlit("do_if");     break;
-        case NODE_ST_ELSIF:  node->block.name = b_fromlit("do_elseif"); break;
-        case NODE_ST_ELSE:   node->block.name = b_fromlit("do_else");   break;
-        case NODE_ST_WHILE:  node->block.name = b_fromlit("do_while");  break;
-        case NODE_ST_FOR:    node->block.name = b_fromlit("do_all");    break;
+        case NODE_ST_UNIMPL: node->block.name = prev->unimpl.id; break;
+        case NODE_ST_IF:
+        case NODE_ST_ELSIF:
+        case NODE_ST_ELSE:
+        case NODE_ST_WHILE:
+        case NODE_ST_FOR:    break;
+        case NODE_ERROR:     break;
         default:
+                /* After a syntax error a block can follow just about anything. */
+                if (data->nerrors)
+                        break;
                 warnx("Invalid block node: %s", ast_node_types_getname(prev->type));
                 abort();
         }
 
+        node->block.opener = prev->type;
         prev->block_parent = true;
-        talloc_steal(node, node->block.name);
+
+out:
+        if (data->events) {
+                ast_events_flush(data);
+                if (data->events->block_begin)
+                        data->events->block_begin(data, node, data->events_arg);
+        }
 }
 
 void
-new_block_comment(ast_data *data, bstring *text)
+new_block_comment(ast_data *data, ast_slice text)
 {
         ast_node *node = ast_node_create(data, NODE_COMMENT);
-        b_strip_leading_ws(text);
-        b_strip_trailing_ws(text);
+        slice_strip_ws(data, &text);
         node->comment  = text;
-        talloc_steal(node, node->comment);
 }
 
 void
@@ -181,37 +940,355 @@ new_blank_line(ast_data *data)
         ast_node_create(data, NODE_BLANK_LINE);
 }
 
+/*
+ * Called once the parser has resynchronized after a syntax error. Whatever
+ * nodes the broken statement had already opened are abandoned by climbing back
+ * to the innermost open block, which is where the parser resumes. The error
+ * node stands in for the statement so the usual RESET_CUR() lands correctly.
+ */
+void
+new_error_statement(ast_data *data)
+{
+        while (data->cur->type != NODE_BLOCK)
+                data->cur = data->cur->parent;
+        ast_node_create(data, NODE_ERROR);
+}
+
 /*======================================================================================*/
 
 void
-new_debug_statement(ast_data *data, bstring *text, bstring *filter)
+new_debug_statement(ast_data *data, ast_expr *text, ast_expr *filter)
 {
-        ast_node *node   = ast_node_create(data, NODE_ST_DEBUG_TEXT);
-        node->debug.text = text;
-        talloc_steal(node, node->debug.text);
-        if (filter) {
-                node->debug.filter = filter;
-                talloc_steal(node, node->debug.filter);
-        }
+        ast_node *node     = ast_node_create(data, NODE_ST_DEBUG_TEXT);
+        node->debug.text   = text;
+        node->debug.filter = filter;
 }
 
 /*======================================================================================*/
 
 void
-append_chance(ast_data *data, bstring *expr)
+append_chance(ast_data *data, ast_expr *expr)
 {
         data->cur->chance = expr;
-        talloc_steal(data->cur, data->cur->chance);
 }
 
 void
-append_line_comment(ast_data *data, bstring *text, const bool prev)
+append_line_comment(ast_data *data, ast_slice text, const bool prev)
 {
-        b_strip_trailing_ws(text);
-        b_strip_leading_ws(text);
+        slice_strip_ws(data, &text);
         ast_node *node = (prev)
-                             ? data->cur->block.list->lst[data->cur->block.list->qty - 1]
+                             ? AST_VEC_AT(&data->cur->block.list, data->cur->block.list.qty - 1)
                              : data->cur;
         node->line_comment = text;
-        talloc_steal(node, node->line_comment);
+}
+
+/*======================================================================================*/
+/* The expression table */
+
+static uint32_t
+expr_hash(const ast_data *data, const ast_expr *expr)
+{
+        uint32_t hash = expr->type;
+
+        switch (expr->type) {
+        case EXPR_TEXT:
+                hash = hash_step(hash, (expr->name) ? expr->name->hash
+                                                    : intern_hash(AST_SLICE_PTR(data, expr->text), expr->text.len));
+                break;
+        case EXPR_BINARY:
+        case EXPR_MEMBER:
+        case EXPR_LIST:
+        case EXPR_FIELD:
+        case EXPR_FIELDS:
+                HASH_EXPR(hash, expr->binary.lhs);
+                HASH_EXPR(hash, expr->binary.rhs);
+                HASH_PTR(hash, expr->binary.op);
+                break;
+        case EXPR_UNARY:
+        case EXPR_POSTFIX:
+                HASH_EXPR(hash, expr->unary.operand);
+                HASH_PTR(hash, expr->unary.op);
+                break;
+        case EXPR_GROUP:
+                HASH_EXPR(hash, expr->group.inner);
+                HASH_PTR(hash, expr->group.open);
+                HASH_PTR(hash, expr->group.close);
+                break;
+        case EXPR_CALL:
+                hash = hash_step(hash, intern_hash(AST_SLICE_PTR(data, expr->call.fn), expr->call.fn.len));
+                HASH_EXPR(hash, expr->call.arg);
+                break;
+        case EXPR_CONDITIONAL:
+                HASH_EXPR(hash, expr->conditional.cond);
+                HASH_EXPR(hash, expr->conditional.yes);
+                HASH_EXPR(hash, expr->conditional.no);
+                break;
+        }
+
+        return hash;
+}
+
+static bool
+expr_equal(const ast_data *data, const ast_expr *a, const ast_expr *b)
+{
+        if (a->hash != b->hash || a->type != b->type)
+                return false;
+
+        switch (a->type) {
+        case EXPR_TEXT:
+                if (a->name || b->name)
+                        return a->name == b->name;
+                return slice_equal(data, a->text, b->text);
+        case EXPR_BINARY:
+        case EXPR_MEMBER:
+        case EXPR_LIST:
+        case EXPR_FIELD:
+        case EXPR_FIELDS:
+                return a->binary.lhs == b->binary.lhs && a->binary.rhs == b->binary.rhs &&
+                       a->binary.op == b->binary.op;
+        case EXPR_UNARY:
+        case EXPR_POSTFIX:
+                return a->unary.operand == b->unary.operand && a->unary.op == b->unary.op;
+        case EXPR_GROUP:
+                return a->group.inner == b->group.inner && a->group.open == b->group.open &&
+                       a->group.close == b->group.close;
+        case EXPR_CALL:
+                return a->call.arg == b->call.arg && slice_equal(data, a->call.fn, b->call.fn);
+        case EXPR_CONDITIONAL:
+                return a->conditional.cond == b->conditional.cond && a->conditional.yes == b->conditional.yes &&
+                       a->conditional.no == b->conditional.no;
+        }
+
+        return false;
+}
+
+static ast_expr *
+expr_lookup(const ast_data *data, const ast_expr *key)
+{
+        const struct ast_expr_table *tab = &data->exprs;
+
+        if (tab->nslots > 0) {
+                const uint32_t mask = tab->nslots - 1;
+                for (uint32_t i = key->hash & mask; tab->slots[i]; i = (i + 1) & mask)
+                        if (expr_equal(data, tab->slots[i], key))
+                                return tab->slots[i];
+        }
+        return NULL;
+}
+
+/* Adds an expression that isn't in the table yet. */
+static void
+expr_insert(ast_data *data, ast_expr *expr)
+{
+        struct ast_expr_table *tab = &data->exprs;
+
+        /* Keep the table at most three quarters full. */
+        if ((tab->qty + 1) * 4 > tab->nslots * 3)
+                expr_table_grow(data);
+
+        const uint32_t mask = tab->nslots - 1;
+        uint32_t       i    = expr->hash & mask;
+
+        while (tab->slots[i])
+                i = (i + 1) & mask;
+        tab->slots[i] = expr;
+        ++tab->qty;
+}
+
+/* Where in the table an expression that is known to be in it is. */
+static uint32_t
+expr_slot(const struct ast_expr_table *tab, const ast_expr *expr)
+{
+        const uint32_t mask = tab->nslots - 1;
+        uint32_t       i    = expr->hash & mask;
+
+        while (tab->slots[i] != expr)
+                i = (i + 1) & mask;
+        return i;
+}
+
+/* Points `ops' at the operand fields of an expression; returns how many it has. */
+static unsigned
+expr_operands(ast_expr *expr, ast_expr **ops[3])
+{
+        switch (expr->type) {
+        case EXPR_TEXT:
+                return 0;
+        case EXPR_BINARY:
+        case EXPR_MEMBER:
+        case EXPR_LIST:
+        case EXPR_FIELD:
+        case EXPR_FIELDS:
+                ops[0] = &expr->binary.lhs;
+                ops[1] = &expr->binary.rhs;
+                return 2;
+        case EXPR_UNARY:
+        case EXPR_POSTFIX:
+                ops[0] = &expr->unary.operand;
+                return 1;
+        case EXPR_GROUP:
+                ops[0] = &expr->group.inner;
+                return 1;
+        case EXPR_CALL:
+                ops[0] = &expr->call.arg;
+                return 1;
+        case EXPR_CONDITIONAL:
+                ops[0] = &expr->conditional.cond;
+                ops[1] = &expr->conditional.yes;
+                ops[2] = &expr->conditional.no;
+                return 3;
+        }
+
+        return 0;
+}
+
+/*
+ * Interns every expression of `part' in the table of `data', operands before
+ * the expressions using them, then points the part's nodes at the results.
+ * Where `data' already has an identical expression the part's copy is simply
+ * left behind in the arena. The operands are followed with a stack of their
+ * own, since expressions can be nested as deeply as they are long. Slices are
+ * offsets into the same input for both, and hashes don't depend on where an
+ * expression is, so none of them need computing again.
+ */
+static void
+join_exprs(ast_data *data, ast_data *part)
+{
+        const struct ast_expr_table *tab = &part->exprs;
+        if (tab->qty == 0)
+                return;
+
+        /* Each expression on the stack has at most three operands above it. */
+        ast_expr **moved = xcalloc(tab->nslots, sizeof *moved);
+        ast_expr **stack = nmalloc(tab->qty * 3 + 1, sizeof *stack);
+
+        for (uint32_t j = 0; j < tab->nslots; ++j) {
+                size_t n = 0;
+                if (tab->slots[j] && !moved[j])
+                        stack[n++] = tab->slots[j];
+
+                while (n > 0) {
+                        ast_expr      *expr = stack[n - 1];
+                        const uint32_t slot = expr_slot(tab, expr);
+                        const size_t   base = n;
+                        ast_expr     **ops[3];
+                        const unsigned nops = expr_operands(expr, ops);
+
+                        if (moved[slot]) {
+                                --n;
+                                continue;
+                        }
+                        for (unsigned k = 0; k < nops; ++k)
+                                if (*ops[k] && !moved[expr_slot(tab, *ops[k])])
+                                        stack[n++] = *ops[k];
+                        if (n > base)
+                                continue;
+
+                        for (unsigned k = 0; k < nops; ++k)
+                                if (*ops[k])
+                                        *ops[k] = moved[expr_slot(tab, *ops[k])];
+                        if (!(moved[slot] = expr_lookup(data, expr))) {
+                                expr_insert(data, expr);
+                                moved[slot] = expr;
+                        }
+                        --n;
+                }
+        }
+
+        /* Only blocks have children, and only as deep as the source nests them. */
+        struct join_frame {
+                const ast_vec *list;
+                unsigned       i;
+        };
+        struct join_frame  local[64];
+        struct join_frame *frames = local;
+        size_t             max    = ARRSIZ(local);
+        size_t             n      = 0;
+
+        frames[n++] = (struct join_frame){&part->top->block.list, 0};
+        while (n > 0) {
+                struct join_frame *frame = &frames[n - 1];
+                if (frame->i == frame->list->qty) {
+                        --n;
+                        continue;
+                }
+
+                ast_node *node = AST_VEC_AT(frame->list, frame->i++);
+                join_node_exprs(tab, moved, node);
+                if (node->type == NODE_BLOCK) {
+                        if (n == max) {
+                                max   *= 2;
+                                frames = (frames == local) ? memcpy(nmalloc(max, sizeof *frames), local, sizeof local)
+                                                           : nrealloc(frames, max, sizeof *frames);
+                        }
+                        frames[n++] = (struct join_frame){&node->block.list, 0};
+                }
+        }
+
+        if (frames != local)
+                xfree(frames);
+        xfree(stack);
+        xfree(moved);
+}
+
+#define JOIN_EXPR(FIELD) ((FIELD) = (FIELD) ? moved[expr_slot(tab, (FIELD))] : NULL)
+
+static void
+join_node_exprs(const struct ast_expr_table *tab, ast_expr *const *moved, ast_node *node)
+{
+        JOIN_EXPR(node->chance);
+
+        switch (node->type) {
+        case NODE_ST_ASSIGN:
+                JOIN_EXPR(node->assignment.var);
+                JOIN_EXPR(node->assignment.expr);
+                break;
+        case NODE_ST_IF:
+        case NODE_ST_ELSIF:
+        case NODE_ST_WHILE:
+                JOIN_EXPR(node->condition);
+                break;
+        case NODE_ST_FOR:
+                JOIN_EXPR(node->forstmt.var);
+                JOIN_EXPR(node->forstmt.ident);
+                break;
+        case NODE_ST_DEBUG_TEXT:
+                JOIN_EXPR(node->debug.text);
+                JOIN_EXPR(node->debug.filter);
+                break;
+        case NODE_ST_UNDEF:
+                JOIN_EXPR(node->string);
+                break;
+        default:
+                break;
+        }
+}
+
+#undef JOIN_EXPR
+
+static bool
+slice_equal(const ast_data *data, const ast_slice a, const ast_slice b)
+{
+        return a.len == b.len && memcmp(AST_SLICE_PTR(data, a), AST_SLICE_PTR(data, b), a.len) == 0;
+}
+
+static void
+expr_table_grow(ast_data *data)
+{
+        struct ast_expr_table *tab  = &data->exprs;
+        ast_expr             **old  = tab->slots;
+        const uint32_t         nold = tab->nslots;
+
+        tab->nslots = (nold) ? nold * 2 : EXPR_TABLE_MIN;
+        tab->slots  = arena_zalloc(data->arena, tab->nslots * sizeof *tab->slots);
+
+        const uint32_t mask = tab->nslots - 1;
+        for (uint32_t j = 0; j < nold; ++j) {
+                if (!old[j])
+                        continue;
+                uint32_t i = old[j]->hash & mask;
+                while (tab->slots[i])
+                        i = (i + 1) & mask;
+                tab->slots[i] = old[j];
+        }
 }
@@ -4,22 +4,25 @@
 #include "Common.h"
 #include "contrib/P99/p99.h"
 #include "contrib/P99/p99_enum.h"
+#include "util/intern.h"
 #include "util/list.h"
 
 __BEGIN_DECLS
 /*======================================================================================*/
 
-enum ast_data_types { COMPDATA_FILE, COMPDATA_FILENAME, COMPDATA_STRING };
+enum ast_data_types { COMPDATA_FILE, COMPDATA_FILENAME, COMPDATA_STRING, COMPDATA_TOKEN_FILENAME, COMPDATA_STREAM };
 
 /* typedef enum xs_context_type xs_context_type; */
 P99_DECLARE_STRUCT(ast_data);
 P99_DECLARE_STRUCT(ast_node);
 P99_DECLARE_STRUCT(ast_atom);
+P99_DECLARE_STRUCT(ast_expr);
 
 P99_DECLARE_ENUM(ast_node_types,
         NODE_BLANK_LINE,
         NODE_BLOCK,
         NODE_COMMENT,
+        NODE_ERROR,
         NODE_ST_UNIMPL,
         NODE_ST_ASSIGN,
         NODE_ST_ASSIGN_SPECIAL,
@@ -41,50 +44,237 @@ enum ast_assignment_type {
         ASSIGNMENT_ADD,
 };
 
+/*
+ * The whole input is always held in one contiguous buffer followed by the two
+ * NUL bytes flex wants, so it can be handed to yy_scan_buffer() without any
+ * copying. Regular files are mapped, other streams are read in one go, and
+ * bstrings are scanned in place.
+ *
+ * Before scanning, the input is checked to be valid UTF-8, any byte order
+ * mark is skipped (`buf' then points past it, `base' still at the start) and
+ * CRLF line endings are turned into plain LF in place. `crlf' lists the
+ * offsets in `buf' of every newline that lost its CR, in ascending order, so
+ * positions can be mapped back to the original file.
+ *
+ * `lines' holds the offset at which each line starts, for the first
+ * `indexed' bytes. It is only built, by ast_input_locate(), the first time a
+ * position is needed, and only extended over input that has arrived since.
+ *
+ * A stream input starts out empty and grows with ast_input_append() as the
+ * input arrives, being normalized a chunk at a time. Only the first `len'
+ * bytes are handed to the scanner; normalized text up to `avail' follows,
+ * and then `raw' bytes that could not be normalized yet because the rest of
+ * the character, or the LF after a CR, is still to come. For every other
+ * kind `avail' is `len' and `raw' is 0.
+ */
+struct ast_input {
+        uchar    *buf;
+        uchar    *base;
+        size_t    len;
+        size_t    avail;
+        size_t    raw;
+        size_t    maplen;   /* Size of the mapping, or of the buffer for a stream */
+        uint32_t *crlf;
+        uint32_t  ncrlf;
+        uint32_t *lines;
+        uint32_t  nlines;
+        size_t    indexed;
+        bool      bom;
+        enum ast_input_kind {
+                INPUT_MAPPED,
+                INPUT_HEAP,
+                INPUT_BORROWED,
+                INPUT_STREAM,
+        } kind;
+};
+
+#define AST_INPUT_PAD 2
+
+/* Line and column are 1 based; the column counts characters, not bytes. */
+struct ast_position {
+        uint32_t line;
+        uint32_t column;
+        uint32_t line_off;
+        uint32_t line_len;
+};
+
+/*
+ * A view of some text in the input buffer. Tokens carry these instead of
+ * copies of their text, and anything that is stored verbatim (comments,
+ * unimplemented statement ids and attributes) keeps the view as well. An
+ * all-zero slice means "not present"; nothing real can start at offset 0
+ * with length 0 where a slice is optional.
+ */
+typedef struct ast_slice {
+        uint32_t off;
+        uint32_t len;
+} ast_slice;
+
+#define AST_SLICE_PTR(data, slice) ((data)->input->buf + (slice).off)
+#define ast_slice_isset(slice)     ((slice).off != 0 || (slice).len != 0)
+
+/*
+ * Expressions are built as trees by the parser and only turned into text by
+ * ast_expr_render() when the output is written, which does it in one pass.
+ * Identifiers and literals are slices of the input. The kinds differ mostly in
+ * how the operands are spaced in the output:
+ *
+ *     EXPR_BINARY       lhs op rhs
+ *     EXPR_MEMBER       lhs.rhs
+ *     EXPR_LIST         lhs, rhs
+ *     EXPR_FIELD        lhs="rhs"
+ *     EXPR_FIELDS       lhs rhs
+ *     EXPR_UNARY        op operand
+ *     EXPR_POSTFIX      operand op
+ *     EXPR_GROUP        open inner close
+ *     EXPR_CALL         fn(arg)
+ *     EXPR_CONDITIONAL  if (cond) then yes else no
+ *
+ * A NULL expression renders as nothing.
+ *
+ * Expressions are hash-consed: building one that is identical to one already
+ * in the tree returns the existing one, so a condition repeated hundreds of
+ * times is stored once, and two expressions of the same tree are equal iff
+ * the pointers are. Identical text counts as identical wherever it is in the
+ * input. They must therefore never be changed once built. Trees parsed in
+ * parts (see parallel.h) are interned again as the parts are joined, so the
+ * same holds for them.
+ */
+enum ast_expr_type {
+        EXPR_TEXT,
+        EXPR_BINARY,
+        EXPR_MEMBER,
+        EXPR_LIST,
+        EXPR_FIELD,
+        EXPR_FIELDS,
+        EXPR_UNARY,
+        EXPR_POSTFIX,
+        EXPR_GROUP,
+        EXPR_CALL,
+        EXPR_CONDITIONAL,
+};
+
+struct ast_expr {
+        uint8_t  type;      /* enum ast_expr_type */
+        uint8_t  op_len;    /* Length of binary.op, unary.op or group.open */
+        uint8_t  close_len; /* Length of group.close */
+        uint32_t hash;
+        union {
+                struct {
+                        ast_slice              text;
+                        const interned_string *name; /* Set for variables and other names */
+                };
+                struct {
+                        ast_expr   *lhs;
+                        ast_expr   *rhs;
+                        const char *op;
+                } binary;
+                struct {
+                        ast_expr   *operand;
+                        const char *op;
+                } unary;
+                struct {
+                        ast_expr   *inner;
+                        const char *open;
+                        const char *close;
+                } group;
+                struct {
+                        ast_slice fn;
+                        ast_expr *arg;
+                } call;
+                struct {
+                        ast_expr *cond;
+                        ast_expr *yes;
+                        ast_expr *no;
+                } conditional;
+        };
+};
+
+/*
+ * The children of a block, or the arguments of an unimplemented statement.
+ * The first few are kept in the vector itself, so most lists need no memory
+ * of their own. Longer ones move to an array from the tree's arena, which is
+ * simply left behind when it has to grow again. There is no locking, as a
+ * tree is only ever built by one thread.
+ */
+#define AST_VEC_INLINE 3
+
+typedef struct ast_vec {
+        uint32_t qty;
+        uint32_t max; /* 0 while the items are inline */
+        union {
+                void  *inl[AST_VEC_INLINE];
+                void **lst;
+        };
+} ast_vec;
+
+#define AST_VEC_ITEMS(vec) ((vec)->max ? (vec)->lst : (vec)->inl)
+#define AST_VEC_AT(vec, i) (AST_VEC_ITEMS(vec)[i])
+
 struct ast_data {
         ast_node *cur;
         ast_node *top;
-        struct fp_wrap_s {
-                FILE *fp;
-        } *fp_wrap;
+        struct ast_input    *input;
+        struct token_stream *tokens; /* Set when parsing a pre-lexed file */
+        struct arena        *arena;  /* Owns every node but `top', their lists, atoms and expressions */
+
+        /* Every distinct expression built so far, in an open addressed table
+         * from the arena that is left behind when it grows. */
+        struct ast_expr_table {
+                ast_expr **slots;
+                uint32_t   nslots; /* A power of 2, or 0 */
+                uint32_t   qty;
+        } exprs;
 
         uint32_t      mask;
-        uint32_t      column;
+        uint32_t      loc;     /* Where the rule being reduced starts */
+        uint32_t      nerrors; /* Syntax errors reported so far */
+        bool          quiet;   /* Count syntax errors without printing them */
+
+        /* If set, called every time a top level statement has been parsed. */
+        void (*statement_cb)(ast_data *data, void *arg);
+        void  *statement_arg;
+
+        /* If set, nodes are reported as they are completed; see ast_events.h. */
+        const struct ast_events *events;
+        void                    *events_arg;
+        ast_node                *pending; /* Closed statement not yet reported */
 };
 
 struct ast_node {
         ast_node *parent;
-        bstring  *chance;
-        bstring  *line_comment;
+        ast_expr *chance;
+        ast_slice line_comment;
         union {
-                bstring *string; /* Generic */
-                bstring *comment;
-                bstring *condition;
-                bstring *keyword;
+                ast_expr *string; /* Generic */
+                ast_slice comment;
+                ast_expr *condition;
                 struct {
-                        bstring *name;
-                        genlist *list;
+                        ast_vec                list;
+                        const interned_string *name; /* Closing tag of unimplemented statements */
+                        enum ast_node_types    opener;
                 } block;
                 struct {
-                        genlist *list;
-                        bstring *id;
+                        ast_vec                list;
+                        const interned_string *id;
                 } unimpl;
                 struct {
-                        bstring *var;
-                        bstring *expr;
+                        ast_expr *var;
+                        ast_expr *expr;
                         enum ast_assignment_type type;
                 } assignment;
                 struct {
-                        bstring *text;
-                        bstring *filter;
+                        ast_expr *text;
+                        ast_expr *filter;
                 } debug;
                 struct {
-                        bstring *var;
-                        bstring *ident;
-                        bool     reversed;
+                        ast_expr *var;
+                        ast_expr *ident;
+                        bool      reversed;
                 } forstmt;
         };
         enum ast_node_types type;
+        uint32_t            src; /* Offset in the input of the text the node came from */
         uint16_t            depth;
         bool                block_parent;
 };
@@ -104,8 +294,8 @@ struct ast_atom {
                 int      none;
                 bstring *identifier;
                 struct unimplemented_subexpr {
-                        bstring *id;
-                        bstring *text;
+                        const interned_string *id;
+                        ast_slice              text;
                 } unimpl;
         };
 };
@@ -130,23 +320,46 @@ struct distance {
 
 ast_data * ast_data_create_(const void *src, const enum ast_data_types type);
 ast_node * ast_node_create(ast_data *data, enum ast_node_types type);
+void       ast_vec_append(ast_data *data, ast_vec *vec, void *item);
+void       ast_events_closed(ast_data *data, ast_node *node);
+void       ast_events_flush(ast_data *data);
+bstring  * ast_slice_dup(const ast_data *data, ast_slice slice);
+ast_data * ast_data_fork(const ast_data *data, uchar *buf, size_t len);
+ast_data * ast_data_borrow(uchar *buf, size_t len);
+void       ast_data_join(ast_data *data, ast_data *part);
+bool       ast_data_settled(const ast_data *data);
+void       ast_data_release(ast_data *data);
+size_t     ast_input_source_offset(const struct ast_input *input, size_t off);
+bool       ast_input_append(struct ast_input *input, const void *chunk, size_t size, bool final);
+struct ast_position ast_input_locate(struct ast_input *input, size_t off);
+const interned_string * ast_slice_intern(const ast_data *data, ast_slice slice);
+
+ast_expr * ast_expr_text       (ast_data *data, ast_slice text);
+ast_expr * ast_expr_name       (ast_data *data, ast_slice text);
+ast_expr * ast_expr_binary     (ast_data *data, enum ast_expr_type type, ast_expr *lhs, const char *op, ast_expr *rhs);
+ast_expr * ast_expr_unary      (ast_data *data, enum ast_expr_type type, const char *op, ast_expr *operand);
+ast_expr * ast_expr_group      (ast_data *data, const char *open, ast_expr *inner, const char *close);
+ast_expr * ast_expr_call       (ast_data *data, ast_slice fn, ast_expr *arg);
+ast_expr * ast_expr_conditional(ast_data *data, ast_expr *cond, ast_expr *yes, ast_expr *no);
+void       ast_expr_render     (const ast_data *data, const ast_expr *expr, bstring *out);
 
 /*======================================================================================*/
 
 extern void new_blank_line(ast_data *data);
-extern void new_unimpl_statement(ast_data *data, bstring *id);
-extern void new_unimpl_subexpr(ast_data *data, bstring *id, bstring *statement);
+extern void new_unimpl_statement(ast_data *data, ast_slice id);
+extern void new_unimpl_subexpr(ast_data *data, ast_slice id, ast_slice statement);
 extern void new_block(ast_data *data);
-extern void new_block_comment(ast_data *data, bstring *text);
-extern void new_assignment_statement(ast_data *data, bstring *var, bstring *expr, enum ast_assignment_type type);
-extern void new_conditional_statement(ast_data *data, bstring *expr, int type);
-extern void new_debug_statement(ast_data *data, bstring *text, bstring *filter);
-extern void new_simple_statement(ast_data *data, bstring *keyword, int type);
-extern void new_undef_statement(ast_data *data, bstring *var);
-extern void new_for_statement(ast_data *data, bstring *var, bstring *ident, int reversed);
-
-extern void append_chance(ast_data *data, bstring *expr);
-extern void append_line_comment(ast_data *data, bstring *text, bool prev);
+extern void new_block_comment(ast_data *data, ast_slice text);
+extern void new_error_statement(ast_data *data);
+extern void new_assignment_statement(ast_data *data, ast_expr *var, ast_expr *expr, enum ast_assignment_type type);
+extern void new_conditional_statement(ast_data *data, ast_expr *expr, int type);
+extern void new_debug_statement(ast_data *data, ast_expr *text, ast_expr *filter);
+extern void new_simple_statement(ast_data *data, int type);
+extern void new_undef_statement(ast_data *data, ast_expr *var);
+extern void new_for_statement(ast_data *data, ast_expr *var, ast_expr *ident, int reversed);
+
+extern void append_chance(ast_data *data, ast_expr *expr);
+extern void append_line_comment(ast_data *data, ast_slice text, bool prev);
 
 /*======================================================================================*/
 __END_DECLS
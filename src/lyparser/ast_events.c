@@ -0,0 +1,48 @@
+#include "Common.h"
+
+#include "ast_events.h"
+#include "parser.tab.h"
+#include "lexer.h"
+
+static void events_settled(ast_data *data, void *arg);
+
+/*======================================================================================*/
+
+int
+ast_events_parse(ast_data *data, const struct ast_events *events, void *arg)
+{
+        yyscan_t        scanner;
+        YY_BUFFER_STATE buf = NULL;
+        int             ret;
+
+        data->events        = events;
+        data->events_arg    = arg;
+        data->statement_cb  = events_settled;
+        data->statement_arg = NULL;
+
+        yylex_init_extra(data, &scanner);
+        if (!data->tokens)
+                buf = yy_scan_buffer((char *)data->input->buf, data->input->len + AST_INPUT_PAD, scanner);
+        ret = yyparse(scanner, data);
+        if (buf)
+                yy_delete_buffer(buf, scanner);
+        yylex_destroy(scanner);
+
+        ast_events_flush(data);
+        ast_data_release(data);
+        data->events       = NULL;
+        data->statement_cb = NULL;
+
+        return (ret != 0 || data->nerrors > 0) ? 1 : 0;
+}
+
+/* Called after each top-level statement. Once nothing more can attach to what
+ * has been parsed, the last of it is reported and the tree is let go. */
+static void
+events_settled(ast_data *data, void *arg)
+{
+        if (!ast_data_settled(data))
+                return;
+        ast_events_flush(data);
+        ast_data_release(data);
+}
@@ -0,0 +1,43 @@
+#ifndef AST_EVENTS_H_
+#define AST_EVENTS_H_
+
+#include "Common.h"
+#include "ast.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Callbacks for tools that only need one pass over a script, such as counting
+ * statements of some kind or pulling out the debug statements, and have no use
+ * for the tree. Each node is handed over once it is complete, in input order:
+ *
+ *     statement    any node but a block: a statement, comment, blank line,
+ *                  or an error standing in for a statement that didn't parse
+ *     block_begin  a block, after the statement it belongs to (if any), which
+ *                  `block.opener' names
+ *     block_end    the same block, after everything in it
+ *
+ * A node and its expressions are only valid during the call; its `parent'
+ * and `block.list' are not to be relied on. Any callback may be NULL.
+ *
+ * The current top-level statement is still put together in the tree's arena,
+ * as the builders need it to place line comments and to tell what a block
+ * belongs to, but it is released as soon as it has been reported, so memory
+ * use doesn't grow with the size of the input.
+ */
+struct ast_events {
+        void (*statement)  (const ast_data *data, const ast_node *node, void *arg);
+        void (*block_begin)(const ast_data *data, const ast_node *block, void *arg);
+        void (*block_end)  (const ast_data *data, const ast_node *block, void *arg);
+};
+
+/*
+ * Parses all of `data's input, reporting nodes through `events'. Returns 0
+ * if it parsed cleanly and nonzero otherwise; errors are reported as usual.
+ */
+extern int ast_events_parse(ast_data *data, const struct ast_events *events, void *arg);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* ast_events.h */
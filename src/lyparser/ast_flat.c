@@ -0,0 +1,188 @@
+#include "Common.h"
+#include <talloc.h>
+
+#include "ast_flat.h"
+
+/* Makes room for `MORE' more entries in one of the side tables. */
+#define FLAT_RESERVE(FLAT, ARR, N, MORE)                                                    \
+        do {                                                                                \
+                if ((FLAT)->N + (MORE) > talloc_array_length((FLAT)->ARR))                  \
+                        (FLAT)->ARR = talloc_realloc((FLAT), (FLAT)->ARR, __typeof__(*(FLAT)->ARR), \
+                                                     MAX(64U, ((FLAT)->N + (MORE)) * 2U));   \
+        } while (0)
+
+static ast_ref add_node(struct ast_flat *flat, const ast_node *node, ast_ref parent);
+
+/* Node and assignment types have to fit in `sub'. */
+static_assert(NODE_ST_UNDEF < 16, "node types must fit in ast_flat_node.sub");
+
+/*======================================================================================*/
+
+struct ast_flat *
+ast_flat_create(const void *talloc_ctx)
+{
+        return talloc_zero(talloc_ctx, struct ast_flat);
+}
+
+/*
+ * Replaces whatever `flat' held with a copy of the tree under `root'. An
+ * explicit stack is used rather than recursion, since blocks can be nested
+ * very deeply.
+ */
+void
+ast_flat_build(struct ast_flat *flat, const ast_node *root)
+{
+        struct build_frame {
+                const ast_node *node;
+                unsigned        child;
+                ast_ref         ref;
+                ast_ref         last;
+        };
+        struct build_frame  local[64];
+        struct build_frame *stack = local;
+        size_t              max   = ARRSIZ(local);
+        size_t              n     = 0;
+
+        flat->nnodes = flat->nexprs = flat->ncomments = flat->nnames = 0;
+        flat->nunimpl = flat->nargs = flat->nextras = 0;
+
+        const ast_ref top = add_node(flat, root, AST_REF_NONE);
+        if (root->type == NODE_BLOCK)
+                stack[n++] = (struct build_frame){root, 0, top, AST_REF_NONE};
+
+        while (n > 0) {
+                struct build_frame *frame = &stack[n - 1];
+                const ast_vec      *list  = &frame->node->block.list;
+
+                if (frame->child == list->qty) {
+                        --n;
+                        continue;
+                }
+
+                const ast_node *child = AST_VEC_AT(list, frame->child++);
+                const ast_ref   ref   = add_node(flat, child, frame->ref);
+
+                if (frame->last == AST_REF_NONE)
+                        flat->nodes[frame->ref].first_child = ref;
+                else
+                        flat->nodes[frame->last].next_sibling = ref;
+                frame->last = ref;
+
+                if (child->type == NODE_BLOCK) {
+                        if (n == max) {
+                                max  *= 2;
+                                stack = (stack == local) ? memcpy(nmalloc(max, sizeof *stack), local, sizeof local)
+                                                         : nrealloc(stack, max, sizeof *stack);
+                        }
+                        stack[n++] = (struct build_frame){child, 0, ref, AST_REF_NONE};
+                }
+        }
+
+        if (stack != local)
+                free(stack);
+}
+
+/* Finds the chance expression and line comment of a node flagged AST_FLAT_EXTRA. */
+const struct ast_flat_extra *
+ast_flat_extra(const struct ast_flat *flat, const ast_ref ref)
+{
+        uint32_t lo = 0;
+        uint32_t hi = flat->nextras;
+
+        while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (flat->extras[mid].node < ref)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return (lo < flat->nextras && flat->extras[lo].node == ref) ? &flat->extras[lo] : NULL;
+}
+
+/*======================================================================================*/
+
+static void
+add_exprs(struct ast_flat *flat, struct ast_flat_node *fn, ast_expr *a, ast_expr *b, const unsigned num)
+{
+        FLAT_RESERVE(flat, exprs, nexprs, 2);
+        fn->data                     = flat->nexprs;
+        flat->exprs[flat->nexprs++] = a;
+        if (num > 1)
+                flat->exprs[flat->nexprs++] = b;
+}
+
+static ast_ref
+add_node(struct ast_flat *flat, const ast_node *node, const ast_ref parent)
+{
+        FLAT_RESERVE(flat, nodes, nnodes, 1);
+        const ast_ref         ref = flat->nnodes++;
+        struct ast_flat_node *fn  = &flat->nodes[ref];
+
+        *fn = (struct ast_flat_node){
+                .parent       = parent,
+                .first_child  = AST_REF_NONE,
+                .next_sibling = AST_REF_NONE,
+                .data         = AST_REF_NONE,
+                .src          = node->src,
+                .depth        = node->depth,
+                .type         = (uint8_t)node->type,
+                .flags        = (node->block_parent) ? AST_FLAT_BLOCK_PARENT : 0,
+        };
+
+        switch (node->type) {
+        case NODE_BLOCK:
+                fn->sub = (uint8_t)node->block.opener;
+                if (node->block.name) {
+                        FLAT_RESERVE(flat, names, nnames, 1);
+                        fn->data                     = flat->nnames;
+                        flat->names[flat->nnames++] = node->block.name;
+                }
+                break;
+        case NODE_COMMENT:
+                FLAT_RESERVE(flat, comments, ncomments, 1);
+                fn->data                           = flat->ncomments;
+                flat->comments[flat->ncomments++] = node->comment;
+                break;
+        case NODE_ST_UNIMPL: {
+                const ast_vec *list = &node->unimpl.list;
+                FLAT_RESERVE(flat, unimpl, nunimpl, 1);
+                FLAT_RESERVE(flat, args, nargs, list->qty);
+                fn->data                       = flat->nunimpl;
+                flat->unimpl[flat->nunimpl++] = (struct ast_flat_unimpl){node->unimpl.id, flat->nargs, list->qty};
+                for (unsigned i = 0; i < list->qty; ++i)
+                        flat->args[flat->nargs++] = ((const ast_atom *)AST_VEC_AT(list, i))->unimpl;
+                break;
+        }
+        case NODE_ST_ASSIGN:
+                fn->sub = (uint8_t)node->assignment.type;
+                add_exprs(flat, fn, node->assignment.var, node->assignment.expr, 2);
+                break;
+        case NODE_ST_IF:
+        case NODE_ST_ELSIF:
+        case NODE_ST_WHILE:
+                add_exprs(flat, fn, node->condition, NULL, 1);
+                break;
+        case NODE_ST_FOR:
+                if (node->forstmt.reversed)
+                        fn->flags |= AST_FLAT_REVERSED;
+                add_exprs(flat, fn, node->forstmt.var, node->forstmt.ident, 2);
+                break;
+        case NODE_ST_DEBUG_TEXT:
+                add_exprs(flat, fn, node->debug.text, node->debug.filter, 2);
+                break;
+        case NODE_ST_UNDEF:
+                add_exprs(flat, fn, node->string, NULL, 1);
+                break;
+        default:
+                break;
+        }
+
+        if (node->chance || ast_slice_isset(node->line_comment)) {
+                FLAT_RESERVE(flat, extras, nextras, 1);
+                fn->flags                     |= AST_FLAT_EXTRA;
+                flat->extras[flat->nextras++]  = (struct ast_flat_extra){ref, node->line_comment, node->chance};
+        }
+
+        return ref;
+}
@@ -0,0 +1,96 @@
+#ifndef AST_FLAT_H_
+#define AST_FLAT_H_
+
+#include "Common.h"
+#include "ast.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * A compact, read-only copy of a parsed tree, laid out for writing it out.
+ * The nodes sit in one array in pre-order, so a node's whole subtree directly
+ * follows it and a walk over the whole tree is a scan from start to end.
+ * Nodes refer to each other by 32-bit index rather than by pointer, and what
+ * a node needs beyond its type and place in the tree lives in side tables
+ * for its type, starting at `data':
+ *
+ *     NODE_BLOCK          names[data], the closing tag after an unimplemented
+ *                         statement, if `data' isn't AST_REF_NONE; `sub' is
+ *                         the type of the statement the block belongs to
+ *     NODE_COMMENT        comments[data]
+ *     NODE_ST_UNIMPL      unimpl[data], whose arguments are args[] from
+ *                         `args' on
+ *     NODE_ST_ASSIGN      exprs[data] and exprs[data + 1], the variable and
+ *                         the value; `sub' is the assignment type
+ *     NODE_ST_IF, _ELSIF, exprs[data], the condition
+ *     NODE_ST_WHILE
+ *     NODE_ST_FOR         exprs[data] and exprs[data + 1], the variable and
+ *                         the counter; AST_FLAT_REVERSED may be set
+ *     NODE_ST_DEBUG_TEXT  exprs[data] and exprs[data + 1], the text and the
+ *                         filter
+ *     NODE_ST_UNDEF       exprs[data]
+ *
+ * Chance expressions and line comments are rare, so nodes that have either
+ * are flagged AST_FLAT_EXTRA and found in `extras', which is sorted by node.
+ * `src' is the node's offset in the input, as in the tree. Expressions and
+ * strings are shared with the tree, which must outlive this.
+ */
+typedef uint32_t ast_ref;
+#define AST_REF_NONE UINT32_MAX
+
+enum ast_flat_flags {
+        AST_FLAT_BLOCK_PARENT = 0x01,
+        AST_FLAT_REVERSED     = 0x02,
+        AST_FLAT_EXTRA        = 0x04,
+};
+
+struct ast_flat_node {
+        ast_ref  parent;
+        ast_ref  first_child;
+        ast_ref  next_sibling;
+        uint32_t data;
+        uint32_t src;
+        uint16_t depth;
+        uint8_t  type;
+        uint8_t  sub   : 4;
+        uint8_t  flags : 4;
+};
+
+struct ast_flat_unimpl {
+        const interned_string *id;
+        uint32_t               args;
+        uint32_t               nargs;
+};
+
+struct ast_flat_extra {
+        ast_ref   node;
+        ast_slice line_comment;
+        ast_expr *chance;
+};
+
+struct ast_flat {
+        struct ast_flat_node          *nodes;
+        ast_expr                     **exprs;
+        ast_slice                     *comments;
+        const interned_string        **names;
+        struct ast_flat_unimpl        *unimpl;
+        struct unimplemented_subexpr  *args;
+        struct ast_flat_extra         *extras;
+
+        uint32_t nnodes;
+        uint32_t nexprs;
+        uint32_t ncomments;
+        uint32_t nnames;
+        uint32_t nunimpl;
+        uint32_t nargs;
+        uint32_t nextras;
+};
+
+extern struct ast_flat             *ast_flat_create(const void *talloc_ctx);
+extern void                         ast_flat_build (struct ast_flat *flat, const ast_node *root);
+extern const struct ast_flat_extra *ast_flat_extra (const struct ast_flat *flat, ast_ref ref);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* ast_flat.h */
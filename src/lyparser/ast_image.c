@@ -0,0 +1,507 @@
+#include "Common.h"
+#include <talloc.h>
+
+#include "ast_image.h"
+
+enum image_section {
+        SEC_NODES, SEC_EXPRS, SEC_ROOTS, SEC_COMMENTS, SEC_NAMES,
+        SEC_UNIMPL, SEC_ARGS, SEC_EXTRAS, SEC_STRINGS, SEC_TEXT,
+        NSECTIONS
+};
+
+struct image_writer {
+        void                   *ctx;
+        struct ast_image_header hdr;
+        struct ast_image_expr  *exprs;
+        bstring                *strings;
+
+        /* Offsets in `strings', keyed by the address of the characters, and
+         * indices in `exprs', keyed by the expression. Interned strings,
+         * operators and expressions are all unique by address. */
+        struct slot {
+                const void *key;
+                uint32_t    off;
+        } *slots;
+        uint32_t nslots;
+        uint32_t nused;
+};
+
+static uint64_t image_layout(const struct ast_image_header *hdr, uint64_t off[NSECTIONS]);
+static bool     image_attach(struct ast_image *img);
+static int      image_free(struct ast_image *img);
+static uint32_t add_expr(struct image_writer *w, const ast_expr *root);
+static uint32_t add_string(struct image_writer *w, const char *str, size_t len);
+static struct slot *find_slot(const struct image_writer *w, const void *key);
+static void         fill_slot(struct image_writer *w, struct slot *slot, const void *key, uint32_t off);
+static bool     write_section(FILE *fp, uint64_t *pos, uint64_t off, const void *buf, size_t size);
+static ast_expr load_expr(const struct ast_image *img, ast_expr *exprs, const struct ast_image_expr *ie);
+
+#define SLOT_HASH(KEY, MASK) ((uint32_t)(((uintptr_t)(KEY) * UINT64_C(0x9E3779B97F4A7C15)) >> 40) & (MASK))
+#define ADD_ISTR(W, ISTR) add_string((W), (const char *)(ISTR)->str.data, (ISTR)->str.slen)
+#define ADD_CSTR(W, STR)  ((STR) ? add_string((W), (STR), strlen(STR)) : AST_REF_NONE)
+#define LOAD_EXPR(REF)    (((REF) == AST_REF_NONE) ? NULL : &exprs[(REF)])
+#define LOAD_CSTR(OFF)    (((OFF) == AST_REF_NONE) ? NULL : AST_IMAGE_STR(img, (OFF)))
+#define LOAD_ISTR(OFF)    intern_cstr(AST_IMAGE_STR(img, (OFF)))
+#define CSTR_LEN(STR)     ((STR) ? (uint8_t)strlen(STR) : 0)
+
+/*======================================================================================*/
+
+/*
+ * Writes the tree in `flat', which was built from `data', out as an image.
+ * Returns 0 on success.
+ */
+int
+ast_image_write(const ast_data *data, const struct ast_flat *flat, FILE *fp)
+{
+        void               *tmp = talloc_new(NULL);
+        struct image_writer w   = {
+                .ctx = tmp,
+                .hdr = {
+                        .magic     = AST_IMAGE_MAGIC,
+                        .version   = AST_IMAGE_VERSION,
+                        .node_size = sizeof(struct ast_flat_node),
+                        .nnodes    = flat->nnodes,
+                        .nroots    = flat->nexprs,
+                        .ncomments = flat->ncomments,
+                        .nnames    = flat->nnames,
+                        .nunimpl   = flat->nunimpl,
+                        .nargs     = flat->nargs,
+                        .nextras   = flat->nextras,
+                        .text_len  = data->input->len,
+                },
+                .strings = b_create(4096),
+                .slots   = talloc_zero_array(tmp, struct slot, 256),
+                .nslots  = 256,
+        };
+
+        uint32_t                *roots  = talloc_array(tmp, uint32_t, flat->nexprs);
+        uint32_t                *names  = talloc_array(tmp, uint32_t, flat->nnames);
+        struct ast_image_unimpl *unimpl = talloc_array(tmp, struct ast_image_unimpl, flat->nunimpl);
+        struct ast_image_arg    *args   = talloc_array(tmp, struct ast_image_arg, flat->nargs);
+        struct ast_image_extra  *extras = talloc_array(tmp, struct ast_image_extra, flat->nextras);
+        w.exprs = talloc_array(tmp, struct ast_image_expr, MAX(64U, flat->nexprs * 2U));
+
+        for (uint32_t i = 0; i < flat->nexprs; ++i)
+                roots[i] = add_expr(&w, flat->exprs[i]);
+        for (uint32_t i = 0; i < flat->nnames; ++i)
+                names[i] = ADD_ISTR(&w, flat->names[i]);
+        for (uint32_t i = 0; i < flat->nunimpl; ++i)
+                unimpl[i] = (struct ast_image_unimpl){ADD_ISTR(&w, flat->unimpl[i].id), flat->unimpl[i].args,
+                                                      flat->unimpl[i].nargs};
+        for (uint32_t i = 0; i < flat->nargs; ++i)
+                args[i] = (struct ast_image_arg){ADD_ISTR(&w, flat->args[i].id), flat->args[i].text};
+        for (uint32_t i = 0; i < flat->nextras; ++i)
+                extras[i] = (struct ast_image_extra){flat->extras[i].node, flat->extras[i].line_comment,
+                                                     add_expr(&w, flat->extras[i].chance)};
+        w.hdr.strings_len = w.strings->slen;
+
+        uint64_t off[NSECTIONS];
+        uint64_t pos = 0;
+        image_layout(&w.hdr, off);
+
+        const bool ok =
+            write_section(fp, &pos, 0, &w.hdr, sizeof w.hdr) &&
+            write_section(fp, &pos, off[SEC_NODES], flat->nodes, flat->nnodes * sizeof *flat->nodes) &&
+            write_section(fp, &pos, off[SEC_EXPRS], w.exprs, w.hdr.nexprs * sizeof *w.exprs) &&
+            write_section(fp, &pos, off[SEC_ROOTS], roots, flat->nexprs * sizeof *roots) &&
+            write_section(fp, &pos, off[SEC_COMMENTS], flat->comments, flat->ncomments * sizeof *flat->comments) &&
+            write_section(fp, &pos, off[SEC_NAMES], names, flat->nnames * sizeof *names) &&
+            write_section(fp, &pos, off[SEC_UNIMPL], unimpl, flat->nunimpl * sizeof *unimpl) &&
+            write_section(fp, &pos, off[SEC_ARGS], args, flat->nargs * sizeof *args) &&
+            write_section(fp, &pos, off[SEC_EXTRAS], extras, flat->nextras * sizeof *extras) &&
+            write_section(fp, &pos, off[SEC_STRINGS], w.strings->data, w.strings->slen) &&
+            write_section(fp, &pos, off[SEC_TEXT], data->input->buf, data->input->len);
+
+        b_destroy(w.strings);
+        talloc_free(tmp);
+
+        if (!ok) {
+                warn("Failed to write AST image");
+                return (-1);
+        }
+        return 0;
+}
+
+/*
+ * Maps an image written by ast_image_write(). Returns NULL, having said why,
+ * if it can't be read or isn't a valid image. Free it to unmap it.
+ */
+struct ast_image *
+ast_image_open(const void *talloc_ctx, const char *fname)
+{
+        const int fd = open(fname, O_RDONLY|O_BINARY);
+        if (fd == (-1)) {
+                warn("Failed to open %s", fname);
+                return NULL;
+        }
+
+        struct ast_image *img = talloc_zero(talloc_ctx, struct ast_image);
+        img->base = map_file_padded(fd, AST_INPUT_PAD, &img->len, &img->maplen);
+        if (!img->base)
+                img->base = read_fd_padded(fd, AST_INPUT_PAD, &img->len);
+        close(fd);
+
+        if (!img->base) {
+                warn("Failed to read %s", fname);
+                talloc_free(img);
+                return NULL;
+        }
+        talloc_set_destructor(img, image_free);
+
+        if (!image_attach(img)) {
+                warnx("Error: %s is not an AST image, or one from an incompatible version", fname);
+                talloc_free(img);
+                return NULL;
+        }
+        return img;
+}
+
+/*
+ * Builds a flat tree from an image, for code that works on those, such as the
+ * XML writer. Nodes and comments are used in place, names are interned again
+ * and expressions are turned back into ast_exprs, shared just as they were in
+ * the tree written. Slices still refer to the image's text, so the tree goes
+ * with an ast_data made over that (see ast_data_borrow()). It is freed along
+ * with the image, and must not be rebuilt with ast_flat_build().
+ */
+struct ast_flat *
+ast_image_flat(struct ast_image *img)
+{
+        const struct ast_image_header *hdr   = img->hdr;
+        struct ast_flat               *flat  = talloc_zero(img, struct ast_flat);
+        ast_expr                      *exprs = talloc_array(flat, ast_expr, hdr->nexprs);
+
+        /* Every entry has its place before any is filled in, so operands can
+         * be pointed at whether they come before or after. */
+        for (uint32_t i = 0; i < hdr->nexprs; ++i)
+                exprs[i] = load_expr(img, exprs, &img->exprs[i]);
+
+        flat->nodes     = (struct ast_flat_node *)img->nodes;
+        flat->comments  = (ast_slice *)img->comments;
+        flat->exprs     = talloc_array(flat, ast_expr *, hdr->nroots);
+        flat->names     = talloc_array(flat, const interned_string *, hdr->nnames);
+        flat->unimpl    = talloc_array(flat, struct ast_flat_unimpl, hdr->nunimpl);
+        flat->args      = talloc_array(flat, struct unimplemented_subexpr, hdr->nargs);
+        flat->extras    = talloc_array(flat, struct ast_flat_extra, hdr->nextras);
+        flat->nnodes    = hdr->nnodes;
+        flat->nexprs    = hdr->nroots;
+        flat->ncomments = hdr->ncomments;
+        flat->nnames    = hdr->nnames;
+        flat->nunimpl   = hdr->nunimpl;
+        flat->nargs     = hdr->nargs;
+        flat->nextras   = hdr->nextras;
+
+        for (uint32_t i = 0; i < hdr->nroots; ++i)
+                flat->exprs[i] = LOAD_EXPR(img->roots[i]);
+        for (uint32_t i = 0; i < hdr->nnames; ++i)
+                flat->names[i] = LOAD_ISTR(img->names[i]);
+        for (uint32_t i = 0; i < hdr->nunimpl; ++i)
+                flat->unimpl[i] = (struct ast_flat_unimpl){LOAD_ISTR(img->unimpl[i].id), img->unimpl[i].args,
+                                                           img->unimpl[i].nargs};
+        for (uint32_t i = 0; i < hdr->nargs; ++i)
+                flat->args[i] = (struct unimplemented_subexpr){LOAD_ISTR(img->args[i].id), img->args[i].text};
+        for (uint32_t i = 0; i < hdr->nextras; ++i)
+                flat->extras[i] = (struct ast_flat_extra){img->extras[i].node, img->extras[i].line_comment,
+                                                          LOAD_EXPR(img->extras[i].chance)};
+
+        return flat;
+}
+
+/*======================================================================================*/
+
+/* Works out where each section starts. Returns the size of the whole image. */
+static uint64_t
+image_layout(const struct ast_image_header *hdr, uint64_t off[NSECTIONS])
+{
+        const uint64_t sizes[NSECTIONS] = {
+                [SEC_NODES]    = (uint64_t)hdr->nnodes    * sizeof(struct ast_flat_node),
+                [SEC_EXPRS]    = (uint64_t)hdr->nexprs    * sizeof(struct ast_image_expr),
+                [SEC_ROOTS]    = (uint64_t)hdr->nroots    * sizeof(uint32_t),
+                [SEC_COMMENTS] = (uint64_t)hdr->ncomments * sizeof(ast_slice),
+                [SEC_NAMES]    = (uint64_t)hdr->nnames    * sizeof(uint32_t),
+                [SEC_UNIMPL]   = (uint64_t)hdr->nunimpl   * sizeof(struct ast_image_unimpl),
+                [SEC_ARGS]     = (uint64_t)hdr->nargs     * sizeof(struct ast_image_arg),
+                [SEC_EXTRAS]   = (uint64_t)hdr->nextras   * sizeof(struct ast_image_extra),
+                [SEC_STRINGS]  = hdr->strings_len,
+                [SEC_TEXT]     = hdr->text_len,
+        };
+        uint64_t pos = sizeof *hdr;
+
+        for (unsigned i = 0; i < NSECTIONS; ++i) {
+                pos    = (pos + 7) & ~UINT64_C(7);
+                off[i] = pos;
+                pos   += sizes[i];
+        }
+        return pos;
+}
+
+static bool
+image_attach(struct ast_image *img)
+{
+        const struct ast_image_header *hdr  = img->base;
+        const uchar                   *base = img->base;
+        uint64_t                       off[NSECTIONS];
+
+        if (img->len < sizeof *hdr || memcmp(hdr->magic, AST_IMAGE_MAGIC, sizeof hdr->magic) != 0 ||
+            hdr->version != AST_IMAGE_VERSION || hdr->node_size != sizeof(struct ast_flat_node))
+                return false;
+        /* Keeps the sums in image_layout() from overflowing. */
+        if (hdr->strings_len > img->len || hdr->text_len > img->len)
+                return false;
+        if (image_layout(hdr, off) != img->len)
+                return false;
+        if (hdr->strings_len > 0 && base[off[SEC_STRINGS] + hdr->strings_len - 1] != '\0')
+                return false;
+
+        img->hdr      = hdr;
+        img->nodes    = (const void *)(base + off[SEC_NODES]);
+        img->exprs    = (const void *)(base + off[SEC_EXPRS]);
+        img->roots    = (const void *)(base + off[SEC_ROOTS]);
+        img->comments = (const void *)(base + off[SEC_COMMENTS]);
+        img->names    = (const void *)(base + off[SEC_NAMES]);
+        img->unimpl   = (const void *)(base + off[SEC_UNIMPL]);
+        img->args     = (const void *)(base + off[SEC_ARGS]);
+        img->extras   = (const void *)(base + off[SEC_EXTRAS]);
+        img->strings  = (const char *)(base + off[SEC_STRINGS]);
+        img->text     = base + off[SEC_TEXT];
+        return true;
+}
+
+static int
+image_free(struct ast_image *img)
+{
+        if (img->maplen)
+                unmap_file(img->base, img->maplen);
+        else
+                xfree(img->base);
+        return 0;
+}
+
+/*======================================================================================*/
+
+/*
+ * Appends an expression tree to exprs[] in pre-order and returns the index of
+ * its root. Each entry is filled in when it is reached, and then patched into
+ * the field of its parent it belongs in. Expressions are shared within a tree,
+ * so one that has been written already is only patched in, and the entries
+ * form a graph rather than a tree.
+ */
+static uint32_t
+add_expr(struct image_writer *w, const ast_expr *root)
+{
+        struct pending {
+                const ast_expr *expr;
+                uint32_t        parent;
+                unsigned        field;
+        };
+        struct pending  local[64];
+        struct pending *stack = local;
+        size_t          max   = ARRSIZ(local);
+        size_t          n     = 0;
+
+        if (!root)
+                return AST_REF_NONE;
+        const struct slot *known = find_slot(w, root);
+        if (known->key)
+                return known->off;
+
+        const uint32_t first = w->hdr.nexprs;
+        stack[n++] = (struct pending){root, AST_REF_NONE, 0};
+
+#define PUSH(EXPR, FIELD) \
+        do { if (EXPR) stack[n++] = (struct pending){(EXPR), ref, (FIELD)}; } while (0)
+
+        while (n > 0) {
+                const struct pending p = stack[--n];
+
+                /* No expression has more than three operands. */
+                if (n + 3 > max) {
+                        max  *= 2;
+                        stack = (stack == local) ? memcpy(nmalloc(max, sizeof *stack), local, sizeof local)
+                                                 : nrealloc(stack, max, sizeof *stack);
+                }
+                if (w->hdr.nexprs == talloc_array_length(w->exprs))
+                        w->exprs = talloc_realloc(w->ctx, w->exprs, struct ast_image_expr, w->hdr.nexprs * 2U);
+
+                const ast_expr *expr = p.expr;
+                struct slot    *slot = find_slot(w, expr);
+                const bool      seen = slot->key != NULL;
+                uint32_t        ref  = slot->off;
+
+                if (!seen) {
+                        ref = w->hdr.nexprs++;
+                        fill_slot(w, slot, expr, ref);
+                        w->exprs[ref] = (struct ast_image_expr){
+                                .type = (uint8_t)expr->type,
+                                .op   = AST_REF_NONE,
+                                .a    = AST_REF_NONE,
+                                .b    = AST_REF_NONE,
+                                .c    = AST_REF_NONE,
+                        };
+                }
+
+                if (p.parent != AST_REF_NONE) {
+                        struct ast_image_expr *parent = &w->exprs[p.parent];
+                        switch (p.field) {
+                        case 0:  parent->a = ref; break;
+                        case 1:  parent->b = ref; break;
+                        default: parent->c = ref; break;
+                        }
+                }
+                if (seen)
+                        continue;
+
+                struct ast_image_expr *ie = &w->exprs[ref];
+                switch (expr->type) {
+                case EXPR_TEXT:
+                        ie->a = expr->text.off;
+                        ie->b = expr->text.len;
+                        if (expr->name)
+                                ie->op = ADD_ISTR(w, expr->name);
+                        break;
+                case EXPR_BINARY:
+                        ie->op = ADD_CSTR(w, expr->binary.op);
+                        /* FALLTHROUGH */
+                case EXPR_MEMBER:
+                case EXPR_LIST:
+                case EXPR_FIELD:
+                case EXPR_FIELDS:
+                        PUSH(expr->binary.rhs, 1);
+                        PUSH(expr->binary.lhs, 0);
+                        break;
+                case EXPR_UNARY:
+                case EXPR_POSTFIX:
+                        ie->op = ADD_CSTR(w, expr->unary.op);
+                        PUSH(expr->unary.operand, 0);
+                        break;
+                case EXPR_GROUP:
+                        ie->op = ADD_CSTR(w, expr->group.open);
+                        ie->b  = ADD_CSTR(w, expr->group.close);
+                        PUSH(expr->group.inner, 0);
+                        break;
+                case EXPR_CALL:
+                        ie->a = expr->call.fn.off;
+                        ie->b = expr->call.fn.len;
+                        PUSH(expr->call.arg, 2);
+                        break;
+                case EXPR_CONDITIONAL:
+                        PUSH(expr->conditional.no, 2);
+                        PUSH(expr->conditional.yes, 1);
+                        PUSH(expr->conditional.cond, 0);
+                        break;
+                }
+        }
+
+#undef PUSH
+        if (stack != local)
+                free(stack);
+        return first;
+}
+
+/* Returns the offset of `str' in the string table, adding it if it's new. */
+static uint32_t
+add_string(struct image_writer *w, const char *str, const size_t len)
+{
+        struct slot *slot = find_slot(w, str);
+        if (slot->key)
+                return slot->off;
+
+        const uint32_t off = w->strings->slen;
+        b_catblk(w->strings, str, len);
+        b_catchar(w->strings, '\0');
+        fill_slot(w, slot, str, off);
+        return off;
+}
+
+/* Returns the slot holding `key', or the empty one it would go in. */
+static struct slot *
+find_slot(const struct image_writer *w, const void *key)
+{
+        const uint32_t mask = w->nslots - 1;
+        uint32_t       i    = SLOT_HASH(key, mask);
+
+        while (w->slots[i].key && w->slots[i].key != key)
+                i = (i + 1) & mask;
+        return &w->slots[i];
+}
+
+/* Fills an empty slot returned by find_slot(), which invalidates it. */
+static void
+fill_slot(struct image_writer *w, struct slot *slot, const void *key, const uint32_t off)
+{
+        *slot = (struct slot){key, off};
+
+        /* Keep the table at most half full. */
+        if (++w->nused * 2 > w->nslots) {
+                struct slot   *old  = w->slots;
+                const uint32_t nold = w->nslots;
+
+                w->nslots *= 2;
+                w->slots   = talloc_zero_array(w->ctx, struct slot, w->nslots);
+                for (uint32_t j = 0; j < nold; ++j)
+                        if (old[j].key)
+                                *find_slot(w, old[j].key) = old[j];
+                talloc_free(old);
+        }
+}
+
+/* Turns an image expression back into an ast_expr whose operands are in `exprs'. */
+static ast_expr
+load_expr(const struct ast_image *img, ast_expr *exprs, const struct ast_image_expr *ie)
+{
+        ast_expr expr = {.type = ie->type};
+
+        switch (expr.type) {
+        case EXPR_TEXT:
+                expr.text = (ast_slice){ie->a, ie->b};
+                expr.name = (ie->op == AST_REF_NONE) ? NULL : LOAD_ISTR(ie->op);
+                break;
+        case EXPR_BINARY:
+        case EXPR_MEMBER:
+        case EXPR_LIST:
+        case EXPR_FIELD:
+        case EXPR_FIELDS:
+                expr.binary.lhs = LOAD_EXPR(ie->a);
+                expr.binary.rhs = LOAD_EXPR(ie->b);
+                expr.binary.op  = LOAD_CSTR(ie->op);
+                expr.op_len     = CSTR_LEN(expr.binary.op);
+                break;
+        case EXPR_UNARY:
+        case EXPR_POSTFIX:
+                expr.unary.operand = LOAD_EXPR(ie->a);
+                expr.unary.op      = LOAD_CSTR(ie->op);
+                expr.op_len        = CSTR_LEN(expr.unary.op);
+                break;
+        case EXPR_GROUP:
+                expr.group.inner = LOAD_EXPR(ie->a);
+                expr.group.open  = LOAD_CSTR(ie->op);
+                expr.group.close = LOAD_CSTR(ie->b);
+                expr.op_len      = CSTR_LEN(expr.group.open);
+                expr.close_len   = CSTR_LEN(expr.group.close);
+                break;
+        case EXPR_CALL:
+                expr.call.fn  = (ast_slice){ie->a, ie->b};
+                expr.call.arg = LOAD_EXPR(ie->c);
+                break;
+        case EXPR_CONDITIONAL:
+                expr.conditional.cond = LOAD_EXPR(ie->a);
+                expr.conditional.yes  = LOAD_EXPR(ie->b);
+                expr.conditional.no   = LOAD_EXPR(ie->c);
+                break;
+        }
+
+        return expr;
+}
+
+/* Pads the file with zeros up to `off', where the next section starts, and writes it. */
+static bool
+write_section(FILE *fp, uint64_t *pos, const uint64_t off, const void *buf, const size_t size)
+{
+        static const uchar zeros[8] = {0};
+        const size_t       gap      = (size_t)(off - *pos);
+
+        if ((gap > 0 && fwrite(zeros, 1, gap, fp) != gap) || (size > 0 && fwrite(buf, 1, size, fp) != size))
+                return false;
+        *pos = off + size;
+        return true;
+}
@@ -0,0 +1,122 @@
+#ifndef AST_IMAGE_H_
+#define AST_IMAGE_H_
+
+#include "Common.h"
+#include "ast.h"
+#include "ast_flat.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * A parsed tree saved to a file that other tools can map and use in place,
+ * without parsing the script again or decoding anything. It is the flat tree
+ * of ast_flat.h with every pointer replaced by an index, in native byte order.
+ * After the header come these sections, in this order, each starting on an
+ * 8 byte boundary:
+ *
+ *     struct ast_flat_node    nodes[nnodes]       as in struct ast_flat
+ *     struct ast_image_expr   exprs[nexprs]       every expression node
+ *     uint32_t                roots[nroots]       flat->exprs, as indices into exprs[]
+ *     ast_slice               comments[ncomments]
+ *     uint32_t                names[nnames]       offsets into strings[]
+ *     struct ast_image_unimpl unimpl[nunimpl]
+ *     struct ast_image_arg    args[nargs]
+ *     struct ast_image_extra  extras[nextras]
+ *     char                    strings[strings_len]
+ *     uchar                   text[text_len]      the normalized source
+ *
+ * Node `data' fields index the same tables as in a flat tree, except that
+ * expressions are reached through roots[]. Strings are NUL terminated and
+ * stored once each. Slices refer to `text', which is followed by NULs when
+ * the image is opened, just like a parser's input. An extra's `chance' is an
+ * index into exprs[], and a missing expression is AST_REF_NONE. Expressions
+ * are shared as in the tree, so an entry may be referred to from several
+ * places, but always from before it in exprs[]. How an
+ * expression uses its fields depends on its type:
+ *
+ *     EXPR_TEXT                      a, b: offset and length in text; op: the name, if it is one
+ *     EXPR_BINARY                    a op b
+ *     EXPR_MEMBER, _LIST, _FIELD(S)  a, b
+ *     EXPR_UNARY, EXPR_POSTFIX       op, a
+ *     EXPR_GROUP                     op (the opening), a, b (the closing string)
+ *     EXPR_CALL                      a, b: the function's slice; c: argument
+ *     EXPR_CONDITIONAL               a, b, c
+ *
+ * Only the header and the section bounds are checked on opening, so that it
+ * takes no longer for a large tree than for a small one. The indices within
+ * are trusted to be what ast_image_write() put there.
+ */
+struct ast_image_header {
+        char     magic[4];
+        uint16_t version;
+        uint16_t node_size; /* sizeof(struct ast_flat_node) */
+        uint32_t nnodes;
+        uint32_t nexprs;
+        uint32_t nroots;
+        uint32_t ncomments;
+        uint32_t nnames;
+        uint32_t nunimpl;
+        uint32_t nargs;
+        uint32_t nextras;
+        uint64_t strings_len;
+        uint64_t text_len;
+};
+
+#define AST_IMAGE_MAGIC   "LYAT"
+#define AST_IMAGE_VERSION 1
+
+struct ast_image_expr {
+        uint8_t  type;
+        uint8_t  pad_[3];
+        uint32_t op;
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+};
+
+struct ast_image_unimpl {
+        uint32_t id;
+        uint32_t args;
+        uint32_t nargs;
+};
+
+struct ast_image_arg {
+        uint32_t  id;
+        ast_slice text;
+};
+
+struct ast_image_extra {
+        ast_ref   node;
+        ast_slice line_comment;
+        uint32_t  chance;
+};
+
+struct ast_image {
+        const struct ast_image_header *hdr;
+        const struct ast_flat_node    *nodes;
+        const struct ast_image_expr   *exprs;
+        const uint32_t                *roots;
+        const ast_slice               *comments;
+        const uint32_t                *names;
+        const struct ast_image_unimpl *unimpl;
+        const struct ast_image_arg    *args;
+        const struct ast_image_extra  *extras;
+        const char                    *strings;
+        const uchar                   *text;
+
+        void  *base;
+        size_t len;
+        size_t maplen; /* 0 if read into memory rather than mapped */
+};
+
+#define AST_IMAGE_STR(img, off)     ((img)->strings + (off))
+#define AST_IMAGE_SLICE(img, slice) ((img)->text + (slice).off)
+
+extern int               ast_image_write(const ast_data *data, const struct ast_flat *flat, FILE *fp);
+extern struct ast_image *ast_image_open (const void *talloc_ctx, const char *fname);
+extern struct ast_flat  *ast_image_flat (struct ast_image *img);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* ast_image.h */
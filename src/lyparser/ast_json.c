@@ -0,0 +1,209 @@
+#include "Common.h"
+
+#include "ast_json.h"
+
+#define JSON_FLUSH_SIZE 65536
+
+static void cat_node   (const ast_data *data, const struct ast_flat *flat, ast_ref ref, bstring *out, bstring *tmp);
+static void cat_uint   (bstring *out, uint64_t val);
+static void cat_string (bstring *out, const uchar *str, size_t len);
+static void cat_expr   (const ast_data *data, bstring *out, bstring *tmp, const ast_expr *expr);
+static uint32_t count_children(const struct ast_flat *flat, ast_ref ref);
+
+#define CAT_KEY(out, key)          b_catlit((out), ",\"" key "\":")
+#define CAT_SLICE(out, slice)      cat_string((out), AST_SLICE_PTR(data, slice), (slice).len)
+#define CAT_ISTR(out, istr)        cat_string((out), (istr)->str.data, (istr)->str.slen)
+#define CAT_CSTR(out, str)         cat_string((out), (const uchar *)(str), strlen(str))
+#define CAT_EXPR_FIELD(key, expr)  (CAT_KEY(out, key), cat_expr(data, out, tmp, (expr)))
+
+static const char *const assignment_names[] = {
+        [ASSIGNMENT_NORMAL]  = "normal",
+        [ASSIGNMENT_SPECIAL] = "special",
+        [ASSIGNMENT_NIL]     = "nil",
+        [ASSIGNMENT_ADD]     = "add",
+};
+
+/*======================================================================================*/
+
+size_t
+ast_json_write(const ast_data *data, const struct ast_flat *flat, FILE *fp)
+{
+        bstring *out   = b_create(4096);
+        bstring *tmp   = b_create(256);
+        size_t   total = 0;
+
+        /* The top-level block itself isn't written, just as in the XML. */
+        for (ast_ref ref = 0; ref < flat->nnodes; ++ref) {
+                if (flat->nodes[ref].depth == 0)
+                        continue;
+                cat_node(data, flat, ref, out, tmp);
+                if (out->slen >= JSON_FLUSH_SIZE) {
+                        b_fwrite(fp, out);
+                        total     += out->slen;
+                        out->slen  = 0;
+                }
+        }
+
+        b_fwrite(fp, out);
+        total += out->slen;
+        b_destroy(out);
+        b_destroy(tmp);
+        return total;
+}
+
+/*======================================================================================*/
+
+static void
+cat_node(const ast_data *data, const struct ast_flat *flat, const ast_ref ref, bstring *out, bstring *tmp)
+{
+        const struct ast_flat_node *node  = &flat->nodes[ref];
+        ast_expr *const            *exprs = flat->exprs + node->data;
+
+        b_catlit(out, "{\"type\":\"");
+        b_catcstr(out, ast_node_types_getname(node->type));
+        b_catchar(out, '"');
+        CAT_KEY(out, "depth");
+        cat_uint(out, node->depth);
+        CAT_KEY(out, "offset");
+        cat_uint(out, node->src);
+
+        switch (node->type) {
+        case NODE_BLOCK:
+                CAT_KEY(out, "opener");
+                CAT_CSTR(out, ast_node_types_getname(node->sub));
+                if (node->sub == NODE_ST_UNIMPL && node->data != AST_REF_NONE) {
+                        CAT_KEY(out, "name");
+                        CAT_ISTR(out, flat->names[node->data]);
+                }
+                CAT_KEY(out, "children");
+                cat_uint(out, count_children(flat, ref));
+                break;
+        case NODE_COMMENT:
+                CAT_KEY(out, "text");
+                CAT_SLICE(out, flat->comments[node->data]);
+                break;
+        case NODE_ST_UNIMPL: {
+                const struct ast_flat_unimpl *unimpl = &flat->unimpl[node->data];
+                CAT_KEY(out, "id");
+                CAT_ISTR(out, unimpl->id);
+                CAT_KEY(out, "args");
+                b_catchar(out, '[');
+                for (uint32_t i = 0; i < unimpl->nargs; ++i) {
+                        const struct unimplemented_subexpr *arg = &flat->args[unimpl->args + i];
+                        if (i > 0)
+                                b_catchar(out, ',');
+                        b_catchar(out, '[');
+                        CAT_ISTR(out, arg->id);
+                        b_catchar(out, ',');
+                        CAT_SLICE(out, arg->text);
+                        b_catchar(out, ']');
+                }
+                b_catchar(out, ']');
+                break;
+        }
+        case NODE_ST_ASSIGN:
+                CAT_KEY(out, "assignment");
+                CAT_CSTR(out, assignment_names[node->sub]);
+                CAT_EXPR_FIELD("var", exprs[0]);
+                if (exprs[1])
+                        CAT_EXPR_FIELD("value", exprs[1]);
+                break;
+        case NODE_ST_IF:
+        case NODE_ST_ELSIF:
+        case NODE_ST_WHILE:
+                CAT_EXPR_FIELD("cond", exprs[0]);
+                break;
+        case NODE_ST_FOR:
+                CAT_EXPR_FIELD("var", exprs[0]);
+                CAT_EXPR_FIELD("counter", exprs[1]);
+                if (node->flags & AST_FLAT_REVERSED)
+                        b_catlit(out, ",\"reversed\":true");
+                break;
+        case NODE_ST_DEBUG_TEXT:
+                CAT_EXPR_FIELD("text", exprs[0]);
+                if (exprs[1])
+                        CAT_EXPR_FIELD("filter", exprs[1]);
+                break;
+        case NODE_ST_UNDEF:
+                CAT_EXPR_FIELD("var", exprs[0]);
+                break;
+        default:
+                break;
+        }
+
+        if (node->flags & AST_FLAT_EXTRA) {
+                const struct ast_flat_extra *extra = ast_flat_extra(flat, ref);
+                if (extra->chance)
+                        CAT_EXPR_FIELD("chance", extra->chance);
+                if (ast_slice_isset(extra->line_comment)) {
+                        CAT_KEY(out, "comment");
+                        CAT_SLICE(out, extra->line_comment);
+                }
+        }
+
+        b_catlit(out, "}\n");
+}
+
+static uint32_t
+count_children(const struct ast_flat *flat, const ast_ref ref)
+{
+        uint32_t n = 0;
+        for (ast_ref child = flat->nodes[ref].first_child; child != AST_REF_NONE; child = flat->nodes[child].next_sibling)
+                ++n;
+        return n;
+}
+
+static void
+cat_uint(bstring *out, uint64_t val)
+{
+        char  buf[24];
+        char *p = buf + sizeof buf;
+
+        do
+                *--p = (char)('0' + val % 10);
+        while (val /= 10);
+
+        b_catblk(out, p, buf + sizeof buf - p);
+}
+
+/* Renders the expression into `tmp' first, since its text has to be escaped. */
+static void
+cat_expr(const ast_data *data, bstring *out, bstring *tmp, const ast_expr *expr)
+{
+        tmp->slen = 0;
+        ast_expr_render(data, expr, tmp);
+        cat_string(out, tmp->data, tmp->slen);
+}
+
+/* Appends a quoted JSON string. The input is valid UTF-8, so only quotes,
+ * backslashes and control characters need escaping; runs of anything else
+ * are copied in one go. */
+static void
+cat_string(bstring *out, const uchar *str, const size_t len)
+{
+        const uchar *end = str + len;
+        const uchar *run = str;
+
+        b_catchar(out, '"');
+        for (const uchar *p = str; p < end; ++p) {
+                if (*p >= 0x20 && *p != '"' && *p != '\\')
+                        continue;
+
+                b_catblk(out, run, p - run);
+                run = p + 1;
+                switch (*p) {
+                case '"':  b_catlit(out, "\\\""); break;
+                case '\\': b_catlit(out, "\\\\"); break;
+                case '\n': b_catlit(out, "\\n");  break;
+                case '\t': b_catlit(out, "\\t");  break;
+                default: {
+                        static const char hex[] = "0123456789abcdef";
+                        const char        esc[] = {'\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xF]};
+                        b_catblk(out, esc, sizeof esc);
+                        break;
+                }
+                }
+        }
+        b_catblk(out, run, end - run);
+        b_catchar(out, '"');
+}
@@ -0,0 +1,28 @@
+#ifndef AST_JSON_H_
+#define AST_JSON_H_
+
+#include "Common.h"
+#include "ast.h"
+#include "ast_flat.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Writes the tree in `flat' to `fp' as newline delimited JSON, one object per
+ * node, for tools that would rather not read XML. Every object has the node's
+ * "type" (its enum name), "depth" and "offset" in the input; blocks add
+ * "opener", "name" and "children", and statements their expressions, rendered
+ * as they are in the XML, under names of their own.
+ *
+ * Objects follow each other in pre-order, each block before its children, so
+ * the depth is enough to rebuild the tree. That is not the order of the XML,
+ * which only closes a block after its children. The text is flushed to `fp'
+ * in chunks, and nothing is allocated per node. Returns the number of bytes
+ * written.
+ */
+extern size_t ast_json_write(const ast_data *data, const struct ast_flat *flat, FILE *fp);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* ast_json.h */
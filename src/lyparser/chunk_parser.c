@@ -0,0 +1,267 @@
+#include "Common.h"
+#include <talloc.h>
+
+#include "chunk_parser.h"
+#include "parser.tab.h"
+#include "lexer.h"
+
+/*
+ * The scanner works on a contiguous buffer and can't be stopped in the middle
+ * of a token, so the input is handed to it in segments that end where no
+ * token can straddle the cut. The bytes that arrive are pre-scanned for such
+ * points: a newline outside of any string or comment, directly following a
+ * ';', '{' or '}' as the last thing that is not a blank or a comment. Those
+ * characters can't be part of a longer token, nor can they occur inside an
+ * attribute list, so the scanner is always back in its initial state there.
+ * Only the scanner is restarted at each point; the parser simply waits for
+ * its next token.
+ */
+enum prescan_state { PS_CODE, PS_LINE_COMMENT, PS_BLOCK_COMMENT, PS_STRING };
+
+struct chunk_parser {
+        ast_data        *data;
+        yypstate        *ps;
+        yyscan_t         scanner;
+        chunk_parser_cb *cb;
+        void            *arg;
+
+        size_t scanned;  /* How much of the normalized input has been pre-scanned */
+        size_t safe;     /* The end of the last safe point found */
+        int    lineno;
+        int    status;
+
+        enum prescan_state state;
+        uchar              quote;
+        uchar              prev;
+        uchar              last_sig;
+        uchar              prev_sig;
+};
+
+static int  chunk_parser_destroy(struct chunk_parser *cp);
+static void statement_done(ast_data *data, void *arg);
+static void emit_nodes(struct chunk_parser *cp, bool all);
+static void prescan(struct chunk_parser *cp);
+static void lex_segment(struct chunk_parser *cp, size_t end);
+
+/*======================================================================================*/
+
+struct chunk_parser *
+chunk_parser_create(chunk_parser_cb *cb, void *arg)
+{
+        ast_data *data = ast_data_create_(NULL, COMPDATA_STREAM);
+        if (!data)
+                return NULL;
+
+        struct chunk_parser *cp = talloc_zero(NULL, struct chunk_parser);
+        cp->data     = talloc_steal(cp, data);
+        cp->ps       = yypstate_new();
+        cp->cb       = cb;
+        cp->arg      = arg;
+        cp->lineno   = 1;
+        cp->status   = YYPUSH_MORE;
+        cp->last_sig = ';';
+        yylex_init_extra(data, &cp->scanner);
+        talloc_set_destructor(cp, chunk_parser_destroy);
+
+        data->statement_cb  = statement_done;
+        data->statement_arg = cp;
+        return cp;
+}
+
+ast_data *
+chunk_parser_data(const struct chunk_parser *cp)
+{
+        return cp->data;
+}
+
+/*
+ * Takes the next `len' bytes of input. Whatever complete statements they
+ * allow are parsed and passed to the callback before this returns. Returns 0,
+ * or (-1) if the input is not valid UTF-8 or the parser has given up, after
+ * which nothing more should be pushed.
+ */
+int
+chunk_parser_push(struct chunk_parser *cp, const void *buf, const size_t len)
+{
+        if (cp->status != YYPUSH_MORE)
+                return (-1);
+        if (!ast_input_append(cp->data->input, buf, len, false)) {
+                cp->status = 1;
+                return (-1);
+        }
+
+        prescan(cp);
+        lex_segment(cp, cp->safe);
+        return (cp->status == YYPUSH_MORE) ? 0 : (-1);
+}
+
+/*
+ * Marks the end of the input and parses whatever is left. Returns 0 if the
+ * whole input parsed cleanly and 1 otherwise, the errors having already been
+ * reported.
+ */
+int
+chunk_parser_finish(struct chunk_parser *cp)
+{
+        ast_data        *data  = cp->data;
+        struct ast_input *input = data->input;
+
+        if (cp->status == YYPUSH_MORE) {
+                if (ast_input_append(input, NULL, 0, true)) {
+                        lex_segment(cp, input->avail);
+                        memset(input->buf + input->len, 0, AST_INPUT_PAD);
+                        if (cp->status == YYPUSH_MORE) {
+                                const YYSTYPE lval = {0};
+                                YYLTYPE       lloc = {(uint32_t)input->len};
+                                cp->status = yypush_parse(cp->ps, TOK_EOF, &lval, &lloc, cp->scanner, data);
+                        }
+                } else {
+                        cp->status = 1;
+                }
+        }
+
+        emit_nodes(cp, true);
+        return (cp->status != 0 || data->nerrors > 0) ? 1 : 0;
+}
+
+/*======================================================================================*/
+
+static int
+chunk_parser_destroy(struct chunk_parser *cp)
+{
+        yypstate_delete(cp->ps);
+        yylex_destroy(cp->scanner);
+        return 0;
+}
+
+/* Called by the parser each time it finishes a top-level statement. */
+static void
+statement_done(UNUSED ast_data *data, void *arg)
+{
+        emit_nodes(arg, false);
+}
+
+/*
+ * Hands the top-level nodes to the callback and frees them, unless the last
+ * of them may still change (see ast_data_settled()). At the end of the input
+ * everything goes.
+ */
+static void
+emit_nodes(struct chunk_parser *cp, const bool all)
+{
+        ast_data *data = cp->data;
+        ast_vec  *list = &data->top->block.list;
+
+        if (!all && !ast_data_settled(data))
+                return;
+
+        if (cp->cb)
+                for (unsigned i = 0; i < list->qty; ++i)
+                        cp->cb(data, AST_VEC_AT(list, i), cp->arg);
+        ast_data_release(data);
+}
+
+/*
+ * Runs over the newly normalized input, keeping track of strings and comments
+ * exactly as the scanner will see them, and moves `safe' up to the last point
+ * at which the scanner can be restarted.
+ */
+static void
+prescan(struct chunk_parser *cp)
+{
+        const uchar *buf = cp->data->input->buf;
+        const size_t end = cp->data->input->avail;
+
+        for (size_t i = cp->scanned; i < end; ++i) {
+                const uchar c = buf[i];
+
+                switch (cp->state) {
+                case PS_CODE:
+                        if (c == '\n') {
+                                if (cp->last_sig == ';' || cp->last_sig == '{' || cp->last_sig == '}')
+                                        cp->safe = i + 1;
+                        } else if (c == '/' && cp->prev == '/') {
+                                cp->state    = PS_LINE_COMMENT;
+                                cp->last_sig = cp->prev_sig;
+                        } else if (c == '*' && cp->prev == '/') {
+                                cp->state    = PS_BLOCK_COMMENT;
+                                cp->last_sig = cp->prev_sig;
+                                cp->prev     = 0;
+                                continue;
+                        } else if (c == '"' || c == '\'') {
+                                cp->state = PS_STRING;
+                                cp->quote = c;
+                                cp->prev  = 0;
+                                continue;
+                        } else if (c != ' ' && c != '\t') {
+                                cp->prev_sig = cp->last_sig;
+                                cp->last_sig = c;
+                        }
+                        break;
+                case PS_LINE_COMMENT:
+                        if (c == '\n') {
+                                cp->state = PS_CODE;
+                                if (cp->last_sig == ';' || cp->last_sig == '{' || cp->last_sig == '}')
+                                        cp->safe = i + 1;
+                        }
+                        break;
+                case PS_BLOCK_COMMENT:
+                        if (c == '/' && cp->prev == '*') {
+                                cp->state = PS_CODE;
+                                cp->prev  = 0;
+                                continue;
+                        }
+                        break;
+                case PS_STRING:
+                        if (c == cp->quote && cp->prev != '\\') {
+                                cp->state    = PS_CODE;
+                                cp->prev     = 0;
+                                cp->prev_sig = cp->last_sig;
+                                cp->last_sig = c;
+                                continue;
+                        }
+                        break;
+                }
+
+                cp->prev = c;
+        }
+
+        cp->scanned = end;
+}
+
+/*
+ * Scans the input from where the last segment ended up to `end' and feeds the
+ * tokens to the parser. The two bytes after `end' are borrowed for the NULs
+ * flex wants at the end of its buffer, and `len' is pulled in to `end' so the
+ * scanner's own look-ahead stops there too.
+ */
+static void
+lex_segment(struct chunk_parser *cp, const size_t end)
+{
+        struct ast_input *input = cp->data->input;
+        const size_t      start = input->len;
+        YY_BUFFER_STATE   buf;
+        YYSTYPE           lval;
+        YYLTYPE           lloc;
+        uchar             saved[AST_INPUT_PAD];
+        int               tok;
+
+        if (end <= start || cp->status != YYPUSH_MORE)
+                return;
+
+        memcpy(saved, input->buf + end, AST_INPUT_PAD);
+        memset(input->buf + end, 0, AST_INPUT_PAD);
+        input->len = end;
+
+        buf = yy_scan_buffer((char *)input->buf + start, end - start + AST_INPUT_PAD, cp->scanner);
+        yyset_lineno(cp->lineno, cp->scanner);
+
+        while (cp->status == YYPUSH_MORE && (tok = yylex(&lval, cp->scanner)) != TOK_EOF) {
+                lloc.off   = (uint32_t)((uchar *)yyget_text(cp->scanner) - input->buf);
+                cp->status = yypush_parse(cp->ps, tok, &lval, &lloc, cp->scanner, cp->data);
+        }
+
+        cp->lineno = yyget_lineno(cp->scanner);
+        yy_delete_buffer(buf, cp->scanner);
+        memcpy(input->buf + end, saved, AST_INPUT_PAD);
+}
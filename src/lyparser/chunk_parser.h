@@ -0,0 +1,32 @@
+#ifndef CHUNK_PARSER_H_
+#define CHUNK_PARSER_H_
+
+#include "Common.h"
+#include "ast.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Parses input that arrives a piece at a time, such as from a pipe or a
+ * socket, without ever blocking for more. The caller pushes chunks of any
+ * size, split anywhere, as they come in, and the callback is handed each
+ * top-level node as soon as the statement it belongs to has been parsed.
+ * Because the parser needs one token of lookahead to close a statement, a
+ * statement is usually delivered once the start of the next one has arrived,
+ * and the last one by chunk_parser_finish().
+ *
+ * Each node is freed, along with its expressions, once the callback has
+ * returned, so the tree never holds more than the statement being parsed.
+ */
+struct chunk_parser;
+typedef void (chunk_parser_cb)(ast_data *data, ast_node *node, void *arg);
+
+extern struct chunk_parser *chunk_parser_create(chunk_parser_cb *cb, void *arg);
+extern ast_data            *chunk_parser_data  (const struct chunk_parser *cp);
+extern int                  chunk_parser_push  (struct chunk_parser *cp, const void *buf, size_t len);
+extern int                  chunk_parser_finish(struct chunk_parser *cp);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* chunk_parser.h */
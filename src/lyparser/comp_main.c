@@ -3,77 +3,533 @@
 #include <getopt.h>
 
 #include "ast.h"
+#include "ast_events.h"
+#include "ast_flat.h"
+#include "ast_image.h"
+#include "ast_json.h"
+#include "chunk_parser.h"
+#include "comp_main.h"
+#include "parallel.h"
 #include "parser.tab.h"
+#include "source_map.h"
+#include "token_stream.h"
 
 #include "lexer.h"
 
 #define LPUTS(stream, str) fwrite(("" str ""), 1, (sizeof(str) - 1), (stream))
 #define INDENT_WIDTH 2
+#define INDENT_CHUNK 64 /* Levels of indentation written at once */
+#define STREAM_CHUNK_SIZE 65536
+#define CAT_SLICE(out, slice) b_catblk((out), AST_SLICE_PTR(data, slice), (slice).len)
+#define CAT_EXPR(out, expr)   ast_expr_render(data, (expr), (out))
 
-static int parse_data(ast_data *data, const char *out_fname);
-static void print_data(ast_node *node, bstring *out);
+/* Appends the literal `prefix', the expression and the closing quote of an attribute. */
+#define CAT_EXPR_ATTR(out, prefix, expr) \
+        (b_catlit((out), prefix), CAT_EXPR((out), (expr)), b_catchar((out), '"'))
 
-#define DO_IT(s, o)                                  \
-        do {                                         \
-                ast_data *data = ast_data_create(s); \
-                parse_data(data, (o));               \
-                talloc_free(data);                   \
-        } while (0)
+static int  parse_data(ast_data *data, const struct recompile_options *opts);
+static int  lex_data(ast_data *data, const struct recompile_options *opts);
+static int  count_data(ast_data *data, const struct recompile_options *opts);
+static int  stream_data(const struct recompile_options *opts);
+static int  image_data(const struct recompile_options *opts);
+static void write_data(const ast_data *data, const struct ast_flat *flat, const struct recompile_options *opts);
+static bool input_is_stream(const struct recompile_options *opts);
+static void print_data(const ast_data *data, const struct ast_flat *flat, bstring *out, struct source_map *map);
+static void print_node(const ast_data *data, const struct ast_flat *flat, ast_ref ref, bstring *out, struct source_map *map);
+static void cat_node(const ast_data *data, const struct ast_flat *flat, ast_ref ref, bstring *out);
+static void report_rate(const char *what, const struct timespec *tv1, uint64_t ntokens, size_t nbytes);
 
 /*======================================================================================*/
 
-void
-recompile_main(const char *fname, const char *out_fname)
+int
+recompile_main(const struct recompile_options *opts)
 {
-        if (fname)
-                DO_IT(fname, out_fname);
-        else
-                DO_IT(stdin, out_fname);
+        ast_data *data;
+        int       ret;
+
+        if (opts->lex_only + opts->image + opts->count + opts->json > 1) {
+                warnx("Error: Only one of -l, -b, -c and -N can be given");
+                return 1;
+        }
+        if (opts->image_in && (opts->lex_only || opts->image || opts->count || opts->tokens_in ||
+                               opts->stream || opts->map_fname)) {
+                warnx("Error: An AST image can only be written out whole, as XML or JSON");
+                return 1;
+        }
+        if (opts->lex_only && opts->tokens_in) {
+                warnx("Error: A token stream can't be lexed again");
+                return 1;
+        }
+        if (opts->map_fname && (opts->lex_only || opts->image || opts->count || opts->json)) {
+                warnx("Error: A source map can only be written along with XML");
+                return 1;
+        }
+        if (opts->image && opts->stream) {
+                warnx("Error: An AST image can only be written from the whole tree");
+                return 1;
+        }
+        if (opts->count && opts->stream) {
+                warnx("Error: Counting never keeps the tree, so -c can't be combined with -S");
+                return 1;
+        }
+
+        if (opts->image_in)
+                return image_data(opts);
+
+        /* When streaming, pipes and sockets are parsed as the input arrives
+         * rather than being read to the end first. Without -S they are read
+         * to the end like anything else, so that a syntax error still leaves
+         * nothing written. */
+        if (opts->stream && !opts->tokens_in && !opts->lex_only && input_is_stream(opts))
+                return stream_data(opts);
+
+        if (opts->tokens_in) {
+                if (!opts->in_fname) {
+                        warnx("Error: A token stream must be read from a file");
+                        return 1;
+                }
+                data = ast_data_create_(opts->in_fname, COMPDATA_TOKEN_FILENAME);
+        } else if (opts->in_fname) {
+                data = ast_data_create(opts->in_fname);
+        } else {
+                data = ast_data_create(stdin);
+        }
+
+        if (!data)
+                return 1;
+        ret = (opts->lex_only) ? lex_data(data, opts)
+            : (opts->count)    ? count_data(data, opts)
+                               : parse_data(data, opts);
+        talloc_free(data);
+        return ret;
 }
 
+/* Appends the indentation for a node at `depth', in as few pieces as possible. */
 static inline void
-pspaces(bstring *out, unsigned num)
+pspaces(bstring *out, unsigned depth)
 {
-        if (num-- == 0)
+        static const char spaces[INDENT_CHUNK * INDENT_WIDTH + 1] = {
+                [0 ... INDENT_CHUNK * INDENT_WIDTH - 1] = ' '
+        };
+
+        if (depth-- == 0)
                 return;
-        num *= INDENT_WIDTH;
-        while (num--)
-                b_catchar(out, ' ');
+        for (; depth > INDENT_CHUNK; depth -= INDENT_CHUNK)
+                b_catblk(out, spaces, INDENT_CHUNK * INDENT_WIDTH);
+        b_catblk(out, spaces, depth * INDENT_WIDTH);
+}
+
+static FILE *
+open_output(const struct recompile_options *opts)
+{
+        return (!opts->out_fname || strcmp(opts->out_fname, "-") == 0)
+                   ? stdout
+                   : safe_fopen(opts->out_fname, "wb");
 }
 
+/* A map is only written when asked for, and only alongside XML. */
+static struct source_map *
+open_map(const void *talloc_ctx, const struct recompile_options *opts)
+{
+        if (!opts->map_fname || opts->json)
+                return NULL;
+        return source_map_open(talloc_ctx, opts->map_fname, opts->in_fname);
+}
+
+struct stream_output {
+        FILE              *fp;
+        struct ast_flat   *flat;  /* Reused for each statement */
+        struct source_map *map;
+        bool               json;  /* Write NDJSON rather than XML */
+        bool               flush; /* Flush after every statement, for output read as it's written */
+};
+
+static void stream_statement(ast_data *data, ast_node *node, void *arg);
+static void stream_settled(ast_data *data, void *arg);
+
 static int
-parse_data(ast_data *data, const char *out_fname)
-{
-        FILE *out_fp = (!out_fname || strcmp(out_fname, "-") == 0)
-                           ? stdout
-                           : safe_fopen(out_fname, "wb");
-        yyscan_t scanner;
-        int      ret;
-
-        yylex_init(&scanner);
-        yyset_extra(data, scanner);
-        yyset_in(data->fp_wrap->fp, scanner);
-        data->column = 0;
-        ret          = yyparse(scanner, data);
-        yylex_destroy(scanner);
-
-        if (ret == 0)
-                (void)0;
-        
-        bstring *out = b_create(8192);
-        print_data(data->top, out);
-        b_fwrite(out_fp, out);
-        b_destroy(out);
+parse_data(ast_data *data, const struct recompile_options *opts)
+{
+        FILE           *out_fp;
+        yyscan_t        scanner;
+        YY_BUFFER_STATE buf = NULL;
+        struct timespec tv1;
+        int             ret;
+
+        /* Each statement is written out and freed as soon as it has been
+         * parsed, so the tree never grows beyond the current statement. */
+        struct stream_output so = {0};
+        if (opts->stream) {
+                so.fp               = open_output(opts);
+                so.flat             = ast_flat_create(data);
+                so.map              = open_map(data, opts);
+                so.json             = opts->json;
+                data->statement_cb  = stream_settled;
+                data->statement_arg = &so;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &tv1);
+        const bool parallel = opts->jobs > 1 && !opts->stream && parallel_parse(data, opts->jobs);
+        if (parallel) {
+                ret = 0;
+        } else {
+                yylex_init_extra(data, &scanner);
+                if (!data->tokens)
+                        buf = yy_scan_buffer((char *)data->input->buf, data->input->len + AST_INPUT_PAD, scanner);
+                ret = yyparse(scanner, data);
+                if (buf)
+                        yy_delete_buffer(buf, scanner);
+                yylex_destroy(scanner);
+        }
+
+        if (opts->stats)
+                report_rate((data->tokens) ? "Parsed" : (parallel) ? "Lexed and parsed in parallel" : "Lexed and parsed",
+                            &tv1, (data->tokens) ? data->tokens->ntokens : 0, data->input->len);
+#ifdef PARSER_PROFILE
+        parser_profile_report(stderr);
+#endif
+
+        if (opts->stream) {
+                for (uint32_t i = 0; i < data->top->block.list.qty; ++i)
+                        stream_statement(data, AST_VEC_AT(&data->top->block.list, i), &so);
+                ast_data_release(data);
+                source_map_close(so.map);
+                if (so.fp != stdout)
+                        fclose(so.fp);
+                if (ret != 0 || data->nerrors > 0) {
+                        warnx("%u syntax error%s, output is incomplete", data->nerrors, (data->nerrors == 1) ? "" : "s");
+                        return 1;
+                }
+                return 0;
+        }
+
+        /* The parser recovers from syntax errors so that all of them are
+         * reported in one run, but the result isn't worth writing out. */
+        if (ret != 0 || data->nerrors > 0) {
+                warnx("%u syntax error%s, no output written", data->nerrors, (data->nerrors == 1) ? "" : "s");
+                return 1;
+        }
+
+        struct ast_flat *flat = ast_flat_create(data);
+        ast_flat_build(flat, data->top);
+
+        if (opts->image) {
+                out_fp = open_output(opts);
+                ret    = ast_image_write(data, flat, out_fp);
+                if (out_fp != stdout)
+                        fclose(out_fp);
+                return ret;
+        }
+
+        write_data(data, flat, opts);
+        return 0;
+}
+
+/* Writes out a whole tree, as XML or, with -N, as JSON. */
+static void
+write_data(const ast_data *data, const struct ast_flat *flat, const struct recompile_options *opts)
+{
+        FILE           *out_fp = open_output(opts);
+        struct timespec tv1;
+
+        clock_gettime(CLOCK_MONOTONIC, &tv1);
+        if (opts->json) {
+                const size_t len = ast_json_write(data, flat, out_fp);
+                if (opts->stats)
+                        report_rate("Wrote", &tv1, 0, len);
+        } else {
+                bstring           *out = b_create(8192);
+                struct source_map *map = open_map(data, opts);
+                print_data(data, flat, out, map);
+                if (opts->stats)
+                        report_rate("Wrote", &tv1, 0, out->slen);
+                b_fwrite(out_fp, out);
+                b_destroy(out);
+                source_map_close(map);
+        }
 
         if (out_fp != stdout)
                 fclose(out_fp);
+}
+
+/* Writes out the tree saved in an AST image by -b, without parsing anything. */
+static int
+image_data(const struct recompile_options *opts)
+{
+        if (!opts->in_fname) {
+                warnx("Error: An AST image must be read from a file");
+                return 1;
+        }
+
+        struct ast_image *img = ast_image_open(NULL, opts->in_fname);
+        if (!img)
+                return 1;
+
+        struct ast_flat *flat = ast_image_flat(img);
+        ast_data        *data = ast_data_borrow((uchar *)img->text, img->hdr->text_len);
+        write_data(data, flat, opts);
+
+        talloc_free(data);
+        talloc_free(img);
+        return 0;
+}
+
+static bool
+input_is_stream(const struct recompile_options *opts)
+{
+        struct stat st;
+
+        if ((opts->in_fname ? stat(opts->in_fname, &st) : fstat(STDIN_FILENO, &st)) != 0)
+                return false;
+#ifdef S_ISSOCK
+        if (S_ISSOCK(st.st_mode))
+                return true;
+#endif
+        return S_ISFIFO(st.st_mode);
+}
+
+/* Writes a top-level statement out as soon as it has been parsed. */
+static void
+stream_statement(ast_data *data, ast_node *node, void *arg)
+{
+        struct stream_output *so = arg;
+
+        /* After an error nothing more is written; what was is left as is. */
+        if (data->nerrors > 0)
+                return;
+
+        ast_flat_build(so->flat, node);
+        if (so->json) {
+                ast_json_write(data, so->flat, so->fp);
+        } else {
+                bstring *out = b_create(512);
+                print_data(data, so->flat, out, so->map);
+                b_fwrite(so->fp, out);
+                b_destroy(out);
+        }
+        if (so->flush)
+                fflush(so->fp);
+}
+
+/* Called by the parser after each top-level statement when streaming. */
+static void
+stream_settled(ast_data *data, void *arg)
+{
+        if (!ast_data_settled(data))
+                return;
+        for (uint32_t i = 0; i < data->top->block.list.qty; ++i)
+                stream_statement(data, AST_VEC_AT(&data->top->block.list, i), arg);
+        ast_data_release(data);
+}
+
+static int
+stream_data(const struct recompile_options *opts)
+{
+        struct stream_output so = {.flush = true};
+        struct timespec      tv1;
+        uchar               *buf;
+        size_t               total = 0;
+        int                  fd    = STDIN_FILENO;
+        int                  ret   = 0;
+
+        if (opts->in_fname && (fd = open(opts->in_fname, O_RDONLY|O_BINARY)) == (-1)) {
+                warn("Failed to open %s", opts->in_fname);
+                return 1;
+        }
+
+        struct chunk_parser *cp = chunk_parser_create(stream_statement, &so);
+        if (!cp) {
+                if (fd != STDIN_FILENO)
+                        close(fd);
+                return 1;
+        }
+
+        so.fp   = open_output(opts);
+        so.flat = ast_flat_create(cp);
+        so.map  = open_map(cp, opts);
+        so.json = opts->json;
+        buf     = xmalloc(STREAM_CHUNK_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &tv1);
+
+        for (;;) {
+                const ssize_t n = read(fd, buf, STREAM_CHUNK_SIZE);
+                if (n == 0)
+                        break;
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        warn("Read error");
+                        ret = 1;
+                        break;
+                }
+                total += (size_t)n;
+                if (chunk_parser_push(cp, buf, (size_t)n) != 0)
+                        break;
+        }
+
+        ast_data *data = chunk_parser_data(cp);
+        if (chunk_parser_finish(cp) != 0 || ret != 0) {
+                if (data->nerrors > 0)
+                        warnx("%u syntax error%s, output is incomplete", data->nerrors, (data->nerrors == 1) ? "" : "s");
+                ret = 1;
+        }
+        if (opts->stats)
+                report_rate("Lexed and parsed", &tv1, 0, total);
+#ifdef PARSER_PROFILE
+        parser_profile_report(stderr);
+#endif
+
+        xfree(buf);
+        source_map_close(so.map);
+        talloc_free(cp);
+        if (so.fp != stdout)
+                fclose(so.fp);
+        if (fd != STDIN_FILENO)
+                close(fd);
         return ret;
 }
 
+static int
+lex_data(ast_data *data, const struct recompile_options *opts)
+{
+        FILE           *out_fp = open_output(opts);
+        struct timespec tv1;
+        uint64_t        ntokens;
+        int             ret;
+
+        clock_gettime(CLOCK_MONOTONIC, &tv1);
+        ret = token_stream_write(data, out_fp, &ntokens);
+        if (opts->stats && ret == 0)
+                report_rate("Lexed", &tv1, ntokens, data->input->len);
+
+        if (out_fp != stdout)
+                fclose(out_fp);
+        return ret;
+}
 
 static void
-print_data(ast_node *node, bstring *out)
+count_node(const ast_data *data, const ast_node *node, void *arg)
+{
+        ++((uint64_t *)arg)[node->type];
+}
+
+/* Counts the nodes of each type in one pass, without keeping the tree. */
+static int
+count_data(ast_data *data, const struct recompile_options *opts)
 {
+        static const struct ast_events events = {
+                .statement   = count_node,
+                .block_begin = count_node,
+        };
+        uint64_t        counts[NODE_ST_UNDEF + 1] = {0};
+        struct timespec tv1;
+        int             ret;
+
+        clock_gettime(CLOCK_MONOTONIC, &tv1);
+        ret = ast_events_parse(data, &events, counts);
+        if (opts->stats)
+                report_rate("Counted", &tv1, 0, data->input->len);
+
+        /* The counts are still written after syntax errors, since each broken
+         * statement shows up in them as one NODE_ERROR. */
+        FILE *out_fp = open_output(opts);
+        for (unsigned i = 0; i < ARRSIZ(counts); ++i)
+                if (counts[i] > 0)
+                        fprintf(out_fp, "%-24s %" PRIu64 "\n", ast_node_types_getname(i), counts[i]);
+        if (out_fp != stdout)
+                fclose(out_fp);
+
+        if (ret != 0) {
+                warnx("%u syntax error%s", data->nerrors, (data->nerrors == 1) ? "" : "s");
+                return 1;
+        }
+        return 0;
+}
+
+static void
+report_rate(const char *what, const struct timespec *tv1, const uint64_t ntokens, const size_t nbytes)
+{
+        struct timespec tv2;
+        clock_gettime(CLOCK_MONOTONIC, &tv2);
+        const double secs = SPECDIFF(*tv1, tv2);
+
+        if (ntokens)
+                eprintf("%s %" PRIu64 " tokens (%zu bytes) in %.6fs: %.0f tokens/s, %.1f MiB/s\n",
+                        what, ntokens, nbytes, secs, (double)ntokens / secs, (double)nbytes / secs / (1024.0 * 1024.0));
+        else
+                eprintf("%s %zu bytes in %.6fs: %.1f MiB/s\n",
+                        what, nbytes, secs, (double)nbytes / secs / (1024.0 * 1024.0));
+}
+
+#define CLOSER(TAG) {"</" TAG, sizeof("</" TAG) - 1}
+
+static const struct {
+        const char *str;
+        unsigned    len;
+} block_closers[NODE_ST_UNDEF + 1] = {
+        [NODE_ST_IF]    = CLOSER("do_if"),
+        [NODE_ST_ELSIF] = CLOSER("do_elseif"),
+        [NODE_ST_ELSE]  = CLOSER("do_else"),
+        [NODE_ST_WHILE] = CLOSER("do_while"),
+        [NODE_ST_FOR]   = CLOSER("do_all"),
+};
+
+#undef CLOSER
+
+/*
+ * Writes out the tree in `flat' in a single pass over its nodes. A block is
+ * written when it closes, after everything in it, so the open blocks are kept
+ * on a stack and closed as soon as a node turns up that isn't inside them.
+ * The lines written for each node are recorded in `map', if there is one.
+ */
+static void
+print_data(const ast_data *data, const struct ast_flat *flat, bstring *out, struct source_map *map)
+{
+        ast_ref  local[64];
+        ast_ref *open = local;
+        size_t   max  = ARRSIZ(local);
+        size_t   n    = 0;
+
+        for (ast_ref ref = 0; ref < flat->nnodes; ++ref) {
+                const struct ast_flat_node *node = &flat->nodes[ref];
+
+                while (n > 0 && open[n - 1] != node->parent)
+                        print_node(data, flat, open[--n], out, map);
+
+                if (node->type != NODE_BLOCK) {
+                        print_node(data, flat, ref, out, map);
+                        continue;
+                }
+                if (n == max) {
+                        max *= 2;
+                        open = (open == local) ? memcpy(nmalloc(max, sizeof *open), local, sizeof local)
+                                               : nrealloc(open, max, sizeof *open);
+                }
+                open[n++] = ref;
+        }
+
+        while (n > 0)
+                print_node(data, flat, open[--n], out, map);
+        if (open != local)
+                free(open);
+}
+
+static void
+print_node(const ast_data *data, const struct ast_flat *flat, const ast_ref ref, bstring *out, struct source_map *map)
+{
+        const unsigned start = out->slen;
+
+        cat_node(data, flat, ref, out);
+        if (map)
+                source_map_add(map, data, flat->nodes[ref].src, out->data + start, out->data + out->slen);
+}
+
+static void
+cat_node(const ast_data *data, const struct ast_flat *flat, const ast_ref ref, bstring *out)
+{
+        const struct ast_flat_node *node  = &flat->nodes[ref];
+        ast_expr *const            *exprs = flat->exprs + node->data;
+
         if (node->type != NODE_BLOCK)
                 pspaces(out, node->depth);
 
@@ -82,80 +538,101 @@ print_data(ast_node *node, bstring *out)
                 b_catchar(out, '\n');
                 return; /* Return early */
         case NODE_BLOCK:
-                GENLIST_FOREACH (node->block.list, ast_node *, sub)
-                        print_data(sub, out);
                 pspaces(out, node->depth);
-                if (node->block.name)
-                        b_sprintfa(out, "</%s", node->block.name);
+                if (node->sub == NODE_ST_UNIMPL && node->data != AST_REF_NONE) {
+                        b_catlit(out, "</");
+                        b_concat(out, &flat->names[node->data]->str);
+                } else if (block_closers[node->sub].len) {
+                        b_catblk(out, block_closers[node->sub].str, block_closers[node->sub].len);
+                }
                 break;
         case NODE_COMMENT:
-                b_sprintfa(out, "<!--%s-->\n", node->comment);
+                b_catlit(out, "<!--");
+                CAT_SLICE(out, flat->comments[node->data]);
+                b_catlit(out, "-->\n");
                 return; /* Return early */
-        case NODE_ST_UNIMPL:
-                b_sprintfa(out, "<%s", node->unimpl.id);
-                GENLIST_FOREACH (node->unimpl.list, ast_atom *, atom)
-                        b_sprintfa(out, " %s=%s", atom->unimpl.id, atom->unimpl.text);
+        case NODE_ST_UNIMPL: {
+                const struct ast_flat_unimpl *unimpl = &flat->unimpl[node->data];
+                b_catchar(out, '<');
+                b_concat(out, &unimpl->id->str);
+                for (uint32_t i = 0; i < unimpl->nargs; ++i) {
+                        const struct unimplemented_subexpr *arg = &flat->args[unimpl->args + i];
+                        b_catchar(out, ' ');
+                        b_concat(out, &arg->id->str);
+                        b_catchar(out, '=');
+                        CAT_SLICE(out, arg->text);
+                }
                 break;
+        }
         case NODE_ST_ASSIGN:
-                b_sprintfa(out, "<set_value name=\"%s\"", node->assignment.var);
-                switch (node->assignment.type) {
+                CAT_EXPR_ATTR(out, "<set_value name=\"", exprs[0]);
+                switch (node->sub) {
                 case ASSIGNMENT_NORMAL:
-                        if (node->assignment.expr)
-                                b_sprintfa(out, " exact=\"%s\"", node->assignment.expr);
+                        if (exprs[1])
+                                CAT_EXPR_ATTR(out, " exact=\"", exprs[1]);
                         break;
                 case ASSIGNMENT_SPECIAL:
-                        b_sprintfa(out, " %s", node->assignment.expr);
+                        b_catchar(out, ' ');
+                        CAT_EXPR(out, exprs[1]);
                         break;
                 case ASSIGNMENT_ADD:
-                        b_sprintfa(out, " operation=\"add\"");
+                        b_catlit(out, " operation=\"add\"");
                         break;
                 default:;
                 }
                 break;
         case NODE_ST_IF:
-                b_sprintfa(out, "<do_if value=\"%s\"", node->condition);
+                CAT_EXPR_ATTR(out, "<do_if value=\"", exprs[0]);
                 break;
         case NODE_ST_ELSIF:
-                b_sprintfa(out, "<do_elseif value=\"%s\"", node->condition);
+                CAT_EXPR_ATTR(out, "<do_elseif value=\"", exprs[0]);
                 break;
         case NODE_ST_ELSE:
-                b_sprintfa(out, "<do_else");
+                b_catlit(out, "<do_else");
                 break;
         case NODE_ST_WHILE:
-                b_sprintfa(out, "<do_while value=\"%s\"", node->condition);
+                CAT_EXPR_ATTR(out, "<do_while value=\"", exprs[0]);
                 break;
         case NODE_ST_FOR:
-                b_sprintfa(out, "<do_all exact=\"%s\" counter=\"%s\"", node->forstmt.var, node->forstmt.ident);
-                if (node->forstmt.reversed)
-                        b_sprintfa(out, " reverse=\"true\"");
+                CAT_EXPR_ATTR(out, "<do_all exact=\"", exprs[0]);
+                CAT_EXPR_ATTR(out, " counter=\"", exprs[1]);
+                if (node->flags & AST_FLAT_REVERSED)
+                        b_catlit(out, " reverse=\"true\"");
                 break;
         case NODE_ST_DEBUG_TEXT:
-                b_sprintfa(out, "<debug_text text=\"%s\"", node->debug.text);
-                if (node->debug.filter)
-                        b_sprintfa(out, " filter=\"%s\"", node->debug.filter);
+                CAT_EXPR_ATTR(out, "<debug_text text=\"", exprs[0]);
+                if (exprs[1])
+                        CAT_EXPR_ATTR(out, " filter=\"", exprs[1]);
                 break;
         case NODE_ST_RETURN:
+                b_catlit(out, "<return");
+                break;
         case NODE_ST_BREAK:
-                b_sprintfa(out, "<%s", node->keyword);
+                b_catlit(out, "<break");
                 break;
         case NODE_ST_UNDEF:
-                b_sprintfa(out, "<remove_value name=\"%s\"", node->string);
+                CAT_EXPR_ATTR(out, "<remove_value name=\"", exprs[0]);
                 break;
         default:
                 eprintf("Unknown node: %d\n", node->type);
                 break;
         }
 
-        if (node->chance)
-                b_sprintfa(out, " chance=\"%s\"", node->chance);
-
-        if (node->line_comment)
-                b_sprintfa(out, " comment=\"%s\"", node->line_comment);
+        if (node->flags & AST_FLAT_EXTRA) {
+                const struct ast_flat_extra *extra = ast_flat_extra(flat, ref);
+                if (extra->chance)
+                        CAT_EXPR_ATTR(out, " chance=\"", extra->chance);
+                if (ast_slice_isset(extra->line_comment)) {
+                        b_catlit(out, " comment=\"");
+                        CAT_SLICE(out, extra->line_comment);
+                        b_catchar(out, '"');
+                }
+        }
 
         if (node->depth > 0) {
-                if (node->block_parent || node->type == NODE_BLOCK)
-                        b_sprintfa(out, ">\n");
+                if ((node->flags & AST_FLAT_BLOCK_PARENT) || node->type == NODE_BLOCK)
+                        b_catlit(out, ">\n");
                 else
-                        b_sprintfa(out, "/>\n");
+                        b_catlit(out, "/>\n");
         }
 }
@@ -0,0 +1,28 @@
+#ifndef COMP_MAIN_H_
+#define COMP_MAIN_H_
+
+#include "Common.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+struct recompile_options {
+        const char *in_fname;  /* NULL for stdin */
+        const char *out_fname; /* NULL or "-" for stdout */
+        const char *map_fname; /* Source map, if one is wanted */
+        bool        lex_only;  /* Write a token stream instead of XML */
+        bool        image;     /* Write a binary AST image instead of XML */
+        bool        count;     /* Only count the statements of each type */
+        bool        json;      /* Write NDJSON instead of XML */
+        bool        tokens_in; /* The input is a token stream */
+        bool        image_in;  /* The input is an AST image */
+        bool        stats;     /* Report timings to stderr */
+        bool        stream;    /* Write out and free each statement once parsed */
+        unsigned    jobs;      /* Threads to parse a large file with */
+};
+
+extern int recompile_main(const struct recompile_options *opts);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* comp_main.h */
@@ -0,0 +1,212 @@
+#include "Common.h"
+#include <talloc.h>
+
+#include "parallel.h"
+#include "parser.tab.h"
+#include "lexer.h"
+#include "util/scan.h"
+
+/* Smaller inputs are parsed faster than threads can be started. */
+#define PARALLEL_MIN_SIZE (1024 * 1024)
+#define PARALLEL_MAX_JOBS 64U
+
+struct part {
+        ast_data *data;
+        size_t    start;
+        size_t    end;
+        int       lineno;
+        int       ret;
+        bool      threaded;
+        pthread_t thread;
+        uchar     saved[AST_INPUT_PAD];
+};
+
+enum split_state { SPLIT_CODE, SPLIT_LINE_COMMENT, SPLIT_BLOCK_COMMENT, SPLIT_STRING };
+
+static unsigned find_parts(const struct ast_input *input, unsigned nparts, struct part *parts);
+static bool     block_follows(const uchar *p, const uchar *end);
+static void    *parse_part(void *arg);
+
+/*======================================================================================*/
+
+bool
+parallel_parse(ast_data *data, unsigned njobs)
+{
+        struct ast_input *input = data->input;
+        struct part       parts[PARALLEL_MAX_JOBS];
+        bool              ok    = true;
+
+        if (njobs < 2 || data->tokens || input->len < PARALLEL_MIN_SIZE)
+                return false;
+
+        const unsigned nparts = find_parts(input, MIN(njobs, PARALLEL_MAX_JOBS), parts);
+        if (nparts < 2)
+                return false;
+
+        /* A part's scanner needs two NULs after its end, and those are the
+         * first bytes of the next part. Neighbouring parts therefore scan
+         * different buffers: even ones the input itself and odd ones a copy,
+         * each with NULs written only where the other's parts begin. Offsets
+         * are the same in both, so the nodes can't tell the difference. */
+        uchar *copy = xmalloc(input->len + AST_INPUT_PAD);
+        memcpy(copy, input->buf, input->len + AST_INPUT_PAD);
+
+        for (unsigned i = 0; i < nparts; ++i) {
+                uchar *buf = (i & 1) ? copy : input->buf;
+                memcpy(parts[i].saved, buf + parts[i].end, AST_INPUT_PAD);
+                memset(buf + parts[i].end, 0, AST_INPUT_PAD);
+                parts[i].data = ast_data_fork(data, buf, parts[i].end);
+        }
+
+        for (unsigned i = 1; i < nparts; ++i)
+                parts[i].threaded = pthread_create(&parts[i].thread, NULL, parse_part, &parts[i]) == 0;
+        parse_part(&parts[0]);
+        for (unsigned i = 1; i < nparts; ++i) {
+                if (parts[i].threaded)
+                        pthread_join(parts[i].thread, NULL);
+                else
+                        parse_part(&parts[i]);
+        }
+
+        for (unsigned i = 0; i < nparts; i += 2)
+                memcpy(input->buf + parts[i].end, parts[i].saved, AST_INPUT_PAD);
+        xfree(copy);
+
+        for (unsigned i = 0; i < nparts; ++i)
+                if (parts[i].ret != 0 || parts[i].data->nerrors > 0)
+                        ok = false;
+        for (unsigned i = 0; i < nparts; ++i) {
+                if (ok)
+                        ast_data_join(data, parts[i].data);
+                else
+                        talloc_free(parts[i].data);
+        }
+
+        return ok;
+}
+
+/*======================================================================================*/
+
+/*
+ * Cuts the input into at most `nparts' parts of roughly equal size. A cut is
+ * made after a newline that isn't inside a string or comment, at brace depth
+ * zero, and where the last thing before it other than blanks and comments is
+ * a ';' or a '}'. That is the end of a top-level statement, and the scanner is
+ * in its initial state there. A cut is not made if a block follows, since that
+ * block opens whatever statement came before it. Strings and comments are
+ * followed exactly as the scanner treats them. Returns the number of parts.
+ */
+static unsigned
+find_parts(const struct ast_input *input, const unsigned nparts, struct part *parts)
+{
+        const uchar     *buf      = input->buf;
+        const uchar     *end      = buf + input->len;
+        enum split_state state    = SPLIT_CODE;
+        unsigned         depth    = 0;
+        unsigned         n        = 0;
+        size_t           start    = 0;
+        size_t           target   = input->len / nparts;
+        int              lineno   = 1;
+        uchar            quote    = 0;
+        uchar            prev     = 0;
+        uchar            last_sig = ';';
+        uchar            prev_sig = ';';
+
+        for (const uchar *p = buf; p < end && n < nparts - 1; ++p) {
+                const uchar c   = *p;
+                bool        eol = false;
+
+                switch (state) {
+                case SPLIT_CODE:
+                        if (c == '\n') {
+                                eol = true;
+                        } else if (c == '/' && prev == '/') {
+                                state    = SPLIT_LINE_COMMENT;
+                                last_sig = prev_sig;
+                        } else if (c == '*' && prev == '/') {
+                                state    = SPLIT_BLOCK_COMMENT;
+                                last_sig = prev_sig;
+                                prev     = 0;
+                                continue;
+                        } else if (c == '"' || c == '\'') {
+                                state = SPLIT_STRING;
+                                quote = c;
+                                prev  = 0;
+                                continue;
+                        } else if (c != ' ' && c != '\t') {
+                                if (c == '{')
+                                        ++depth;
+                                else if (c == '}' && depth > 0)
+                                        --depth;
+                                prev_sig = last_sig;
+                                last_sig = c;
+                        }
+                        break;
+                case SPLIT_LINE_COMMENT:
+                        if (c == '\n') {
+                                state = SPLIT_CODE;
+                                eol   = true;
+                        }
+                        break;
+                case SPLIT_BLOCK_COMMENT:
+                        if (c == '/' && prev == '*') {
+                                state = SPLIT_CODE;
+                                prev  = 0;
+                                continue;
+                        }
+                        break;
+                case SPLIT_STRING:
+                        if (c == quote && prev != '\\') {
+                                state    = SPLIT_CODE;
+                                prev     = 0;
+                                prev_sig = last_sig;
+                                last_sig = c;
+                                continue;
+                        }
+                        break;
+                }
+
+                prev = c;
+
+                const size_t off = (size_t)(p - buf) + 1;
+                if (eol && off >= target && depth == 0 && (last_sig == ';' || last_sig == '}') &&
+                    !block_follows(p + 1, end))
+                {
+                        parts[n++] = (struct part){.start = start, .end = off, .lineno = lineno};
+                        lineno    += (int)scan_count(buf + start, buf + off, '\n');
+                        start      = off;
+                        target     = (n + 1) * (input->len / nparts);
+                }
+        }
+
+        parts[n++] = (struct part){.start = start, .end = input->len, .lineno = lineno};
+        return n;
+}
+
+/* Whether the next thing after any blank lines is a block. */
+static bool
+block_follows(const uchar *p, const uchar *end)
+{
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+                ++p;
+        return p < end && *p == '{';
+}
+
+static void *
+parse_part(void *arg)
+{
+        struct part    *part = arg;
+        ast_data       *data = part->data;
+        yyscan_t        scanner;
+        YY_BUFFER_STATE buf;
+
+        yylex_init_extra(data, &scanner);
+        buf = yy_scan_buffer((char *)data->input->buf + part->start,
+                             part->end - part->start + AST_INPUT_PAD, scanner);
+        yyset_lineno(part->lineno, scanner);
+        part->ret = yyparse(scanner, data);
+        yy_delete_buffer(buf, scanner);
+        yylex_destroy(scanner);
+
+        return NULL;
+}
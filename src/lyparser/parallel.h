@@ -0,0 +1,24 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include "Common.h"
+#include "ast.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Parses a large input on up to `njobs' threads. The input is cut into about
+ * equal parts between top-level statements, each part is scanned and parsed
+ * into a tree of its own, and the top-level nodes are then appended to
+ * `data's tree in input order, giving the same tree as a serial parse.
+ *
+ * Returns false, leaving `data' untouched, if the input is too small to be
+ * worth splitting, can't be split, or has syntax errors in any part. The
+ * caller then parses it serially, which also reports any errors in order.
+ */
+extern bool parallel_parse(ast_data *data, unsigned njobs);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* parallel.h */
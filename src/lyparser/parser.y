@@ -1,8 +1,10 @@
 %define api.pure full
+%define api.push-pull both
 %lex-param {void *scanner}
 %parse-param {void *scanner}{ast_data *data}
 %define parse.trace
 %define parse.error verbose
+%locations
 
 %{
 #include "Common.h"
@@ -10,38 +12,83 @@
 /* #include "my_p99_common.h" */
 #include "parser.tab.h"
 #include "lexer.h"
+#include "token_stream.h"
 #include <talloc.h>
 
-extern void yyerror(yyscan_t scanner, ast_data *data, char const *msg);
-extern void cat_relop(bstring *str, int op);
-static void fix_line_comment(bstring *bstr);
-static bstring * handle_unary_op(const int op, bstring *s2);
-
-#define B_CONCAT(b, s)                                 \
-        do {                                           \
-                b_catchar((b), ' ');                   \
-                _Generic((s), bstring *: b_concat,     \
-                              char *: b_catcstr,       \
-                              const char *: b_catcstr, \
-                              int: b_catchar           \
-                        )((b), (s));                   \
+extern void yyerror(YYLTYPE *lloc, yyscan_t scanner, ast_data *data, char const *msg);
+static ast_slice fix_line_comment(const ast_data *data, ast_slice slice);
+static int       parser_lex(YYSTYPE *lval, YYLTYPE *lloc, void *scanner, ast_data *data);
+
+/* A rule starts where its first symbol does, and an empty one where the
+ * symbol before it does. Nodes are created in actions, which run right after
+ * this, and take their position from `data->loc'. */
+#define YYLLOC_DEFAULT(CUR, RHS, N)                                               \
+        do {                                                                      \
+                (CUR).off = ((N) > 0) ? YYRHSLOC(RHS, 1).off : YYRHSLOC(RHS, 0).off; \
+                data->loc = (CUR).off;                                            \
         } while (0)
 
-#define RESET_CUR() (data->cur = data->cur->parent)
+#ifdef PARSER_PROFILE
+/* The hooks are patched into the generated parser by cmake/ProfileParser.cmake. */
+static int  profile_lex(YYSTYPE *lval, YYLTYPE *lloc, void *scanner, ast_data *data);
+static void profile_shift(int kind);
+static void profile_reduce_begin(int rule);
+static void profile_reduce_end(int rule);
+#  define PARSER_PROFILE_SHIFT(KIND)       profile_shift(KIND)
+#  define PARSER_PROFILE_REDUCE_BEGIN(RULE) profile_reduce_begin(RULE)
+#  define PARSER_PROFILE_REDUCE_END(RULE)   profile_reduce_end(RULE)
+#  define yylex(LVAL, LLOC, SCANNER)        profile_lex((LVAL), (LLOC), (SCANNER), data)
+#else
+#  define yylex(LVAL, LLOC, SCANNER)        parser_lex((LVAL), (LLOC), (SCANNER), data)
+#endif
+
+#define RESET_CUR()                                             \
+        do {                                                    \
+                ast_node *closed_ = data->cur;                  \
+                data->cur         = closed_->parent;            \
+                if (data->events)                               \
+                        ast_events_closed(data, closed_);       \
+        } while (0)
+
+/* Closes a statement, and hands it to a waiting caller if it is a top-level one. */
+#define END_STATEMENT()                                               \
+        do {                                                          \
+                RESET_CUR();                                          \
+                if (data->cur == data->top && data->statement_cb)     \
+                        data->statement_cb(data, data->statement_arg); \
+        } while (0)
+
+#define TEXT(s)                    ast_expr_text(data, (s))
+#define NAME(s)                    ast_expr_name(data, (s))
+#define BINARY(type, lhs, op, rhs) ast_expr_binary(data, (type), (lhs), (op), (rhs))
+#define UNARY(type, op, operand)   ast_expr_unary(data, (type), (op), (operand))
+#define GROUP(open, inner, close)  ast_expr_group(data, (open), (inner), (close))
 %}
 
 %code requires
 {
 #include "Common.h"
 #include "ast.h"
+
+/* All a token's location holds is where in the input it starts. */
+typedef struct YYLTYPE {
+        uint32_t off;
+} YYLTYPE;
+#define YYLTYPE_IS_DECLARED 1
+}
+%code provides
+{
+#ifdef PARSER_PROFILE
+extern void parser_profile_report(FILE *fp);
+#endif
 }
 %token TOK_EOF 0 "EOF"
 
 %token OP_FILTER    ">>"
 %token OP_ARROW     "=>"
 %token TOK_ADD      "add"
-%token TOK_BREAK    "break"
-%token TOK_CHANCE   "chance"
+%token <ast_slice> TOK_BREAK  "break"
+%token <ast_slice> TOK_CHANCE "chance"
 %token TOK_DEBUG    "debug"
 %token TOK_ELSE     "else"
 %token TOK_ELSIF    "elsif"
@@ -50,7 +97,7 @@ static bstring * handle_unary_op(const int op, bstring *s2);
 %token TOK_IN       "in"
 %token TOK_LET      "let"
 %token TOK_NULL     "NULL"
-%token TOK_RETURN   "return"
+%token <ast_slice> TOK_RETURN "return"
 %token TOK_THEN     "then"
 %token TOK_UNDEF    "undef"
 %token TOK_WHILE    "while"
@@ -60,28 +107,27 @@ static bstring * handle_unary_op(const int op, bstring *s2);
 %token <int> TOK_TYPEOF
 
 
-%token <bstring *> BARE_LINE_COMMENT "lone_line_comment"
-%token <bstring *> BLOCK_COMMENT     "block_comment"
-%token <bstring *> DISTANCE          "distance value"
-%token <bstring *> LINE_COMMENT      "line_comment"
-%token <bstring *> TIME_VAL          "time value"
-%token <bstring *> TOK_CONST         "global_constant"
-%token <bstring *> TOK_EMPTY_ARRAY   "[]"
-%token <bstring *> TOK_SQRT          "sqrt"
-%token <bstring *> VARIABLE          "$variable"
+%token <ast_slice> BARE_LINE_COMMENT "lone_line_comment"
+%token <ast_slice> BLOCK_COMMENT     "block_comment"
+%token <ast_slice> DISTANCE          "distance value"
+%token <ast_slice> LINE_COMMENT      "line_comment"
+%token <ast_slice> TIME_VAL          "time value"
+%token <ast_slice> TOK_CONST         "global_constant"
+%token <ast_slice> TOK_EMPTY_ARRAY   "[]"
+%token <ast_slice> TOK_SQRT          "sqrt"
+%token <ast_slice> VARIABLE          "$variable"
 
 %token <int> '+' '-' '*' '/' '%' '^' '$' '!' '(' ')' '{' '}' ';' '.' '@' '[' ']' '?' '=' ',' ':'
 
-%type <bstring *>    assignment_statement literal identifier_clash
+%type <ast_expr *>   literal
                      additive_expression multiplicative_expression
                      unary_expression assignment_expression identifier_terminal
-                     debug_print_statement relational_expression terminal
-                     expression primary_expression builtin_function 
-                     unary_expression2 relational_expression2 primary_expression2
-                     identifier additive_expression2 multiplicative_expression2
+                     relational_expression terminal
+                     expression primary_expression identifier member_expression
                      struct_assignment table_assignment
-%type <int>          unary_op multiplicative_op additive_op reversed inexplicable_f
-%type <const char *> relational_op logical_op
+%type <int>          reversed inexplicable_f
+%type <const char *> relational_op logical_op unary_op multiplicative_op additive_op
+%type <ast_slice>    identifier_clash builtin_function
 
 /* These associations are required to avoid conflicts. */
 %left ','
@@ -89,16 +135,17 @@ static bstring * handle_unary_op(const int op, bstring *s2);
 %precedence '='
 
 %token OP_AND OP_OR OP_EQ OP_NE OP_GE OP_LE '<' '>'
-%token <bstring *> TOK_MAX TOK_MIN
+%token <ast_slice> TOK_MAX TOK_MIN
 
 %define api.value.type union
-%token <bstring *> TOK_INTEGER    "number"
-%token <bstring *> TOK_FLOAT      "floating point number"
-%token <bstring *> STRING_LITERAL "string literal"
-%token <bstring *> STRING_UNIMPL  "string"
-%token <bstring *> IDENTIFIER     "identifier"
-%token <bstring *> XML_IDENTIFIER "xml identifier"
+%token <ast_slice> TOK_INTEGER    "number"
+%token <ast_slice> TOK_FLOAT      "floating point number"
+%token <ast_slice> STRING_LITERAL "string literal"
+%token <ast_slice> STRING_UNIMPL  "string"
+%token <ast_slice> IDENTIFIER     "identifier"
+%token <ast_slice> XML_IDENTIFIER "xml identifier"
 <bstring *> BSTRING
+<ast_slice> SLICE
 <char *>    TOK_CSTR
 <int>       TOK_CHAR
 <int>       TOK_VAL
@@ -109,19 +156,30 @@ static bstring * handle_unary_op(const int op, bstring *s2);
 %%
 /*======================================================================================*/
 
+/* Left recursive, so the parser stack doesn't grow with the number of statements. */
 statement_list
-	: statement { RESET_CUR(); }
-	| statement { RESET_CUR(); } statement_list
+	: statement                { END_STATEMENT(); }
+	| statement_list statement { END_STATEMENT(); }
 	;
 
 statement
 	: BLOCK_COMMENT               { new_block_comment(data, $1); }
-	| BARE_LINE_COMMENT           { fix_line_comment($1); new_block_comment(data, $1); }
+	| BARE_LINE_COMMENT           { new_block_comment(data, fix_line_comment(data, $1)); }
 	| BLANK_LINE                  { new_blank_line(data); }
 	| statement_type LINE_COMMENT { append_line_comment(data, $2, 0); }
 	| statement_type              { }
 	;
 
+/*
+ * On a syntax error the parser backs up to the start of the statement, then
+ * skips ahead to the next ';', to a '{' opening the statement's block, or to
+ * the '}' closing the enclosing block, and carries on from there. Whichever it
+ * is, the statement is replaced by exactly one error node, and a block that
+ * follows is parsed as that node's. (If the input ends first, parsing just
+ * stops there.) The error must not be allowed to end a statement on its own:
+ * that reduction would then be taken on any token at all, and every token
+ * skipped would count as another broken statement.
+ */
 statement_type
 	: compound_statement
 	| simple_statement        chance ';'
@@ -130,11 +188,25 @@ statement_type
 	| unimplemented_statement chance ';'
 	| assignment_statement    chance ';'
 	| debug_print_statement   chance ';'
+	| error ';'               { new_error_statement(data); yyerrok; }
+	| error '{' line_comment  { data->loc = @1.off; new_error_statement(data); RESET_CUR();
+	                            data->loc = @2.off; new_block(data); yyerrok; } block_body
 	;
 
 compound_statement
-	: '{' line_comment { new_block(data); } statement_list '}'
-	| '{' line_comment { new_block(data); } '}'
+	: block_open block_body
+	;
+
+/* A block starts at its brace, not at the comment that may follow it. */
+block_open
+	: '{' line_comment { data->loc = @1.off; new_block(data); }
+	;
+
+block_body
+	: statement_list '}'
+	| '}'
+	| statement_list error '}' { data->loc = @2.off; new_error_statement(data); RESET_CUR(); yyerrok; }
+	| error '}'                { new_error_statement(data); RESET_CUR(); yyerrok; }
 	;
 
 chance
@@ -163,7 +235,6 @@ unimplemented_expression
 unimplemented_subexpr 
 	: IDENTIFIER       '=' STRING_UNIMPL  { new_unimpl_subexpr(data, $1, $3); }
 	| XML_IDENTIFIER   '=' STRING_UNIMPL  { new_unimpl_subexpr(data, $1, $3); }
-	| identifier_clash '=' STRING_UNIMPL  { new_unimpl_subexpr(data, $1, $3); }
 	;
 
 /*======================================================================================*/
@@ -173,26 +244,25 @@ assignment_statement
 	: "let" identifier                                { new_assignment_statement(data, $2, NULL, ASSIGNMENT_NORMAL); }
 	| "let" identifier '=' assignment_expression      { new_assignment_statement(data, $2, $4, ASSIGNMENT_NORMAL); }
 	| "let" identifier "=>" '{' struct_assignment '}' { new_assignment_statement(data, $2, $5, ASSIGNMENT_SPECIAL); }
-	| "let" identifier '=' "table" '[' table_assignment ']' { new_assignment_statement(data, $2, b_sprintf("table[ %s ]", $6), ASSIGNMENT_NORMAL); b_free($6); }
+	| "let" identifier '=' "table" '[' table_assignment ']' { new_assignment_statement(data, $2, GROUP("table[ ", $6, " ]"), ASSIGNMENT_NORMAL); }
 	| "add" identifier                                { new_assignment_statement(data, $2, NULL, ASSIGNMENT_ADD); }
 	;
 
 assignment_expression
 	: "if" '(' expression ')' "then" expression "else" expression
-		{ $$ = b_sprintf("if (%s) then %s else %s", $3, $6, $8); b_free($3); b_free($6); b_free($8);/* b_destroy_all($3, $6, $8); */ }
-	/* | "table" '[' expression ']' { $$ = b_sprintf("table[%s]", $3); b_free($3); } */
+		{ $$ = ast_expr_conditional(data, $3, $6, $8); }
 	| expression { $$ = $1; }
 	;
 
 table_assignment
-	: table_assignment ',' table_assignment { $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
-	| identifier '=' expression             { $$ = $1; b_sprintfa($$, " = %s", $3); b_free($3); }
-	| %empty                                { $$ = b_fromlit(""); }
+	: table_assignment ',' table_assignment { $$ = BINARY(EXPR_BINARY, $1, ",", $3); }
+	| identifier '=' expression             { $$ = BINARY(EXPR_BINARY, $1, "=", $3); }
+	| %empty                                { $$ = NULL; }
 	;
 
 struct_assignment
-	: struct_assignment ',' struct_assignment { $$ = $1; B_CONCAT($$, $3); b_free($3); }
-	| identifier ':' expression               { $$ = $1; b_sprintfa($$, "=\"%s\"", $3); b_free($3); }
+	: struct_assignment ',' struct_assignment { $$ = BINARY(EXPR_FIELDS, $1, NULL, $3); }
+	| identifier ':' expression               { $$ = BINARY(EXPR_FIELD, $1, NULL, $3); }
 	;
 
 /*======================================================================================*/
@@ -224,8 +294,8 @@ debug_print_statement
 	;
 
 simple_statement
-	: "return"           { new_simple_statement(data, b_fromlit("return"), NODE_ST_RETURN); }
-	| "break"            { new_simple_statement(data, b_fromlit("break"),  NODE_ST_BREAK); }
+	: "return"           { new_simple_statement(data, NODE_ST_RETURN); }
+	| "break"            { new_simple_statement(data, NODE_ST_BREAK); }
 	| "undef" identifier { new_undef_statement(data, $2); }
 	;
 
@@ -233,39 +303,38 @@ simple_statement
 /* Expressions */
 
 expression
-	: builtin_function '(' expression ')' { $$ = $1; b_sprintfa($$, "(%s)", $3); }
-	/* | expression ',' primary_expression { $$ = $1; if (add_comma) b_catchar($$, ','); B_CONCAT($$, $3); b_free($3); } */
-	| expression ',' primary_expression { $$ = $1; b_catchar($$, ','); B_CONCAT($$, $3); b_free($3); }
-	| expression '.' primary_expression { $$ = $1; b_catchar($$, '.'); b_concat($$, $3); b_free($3); }
+	: builtin_function '(' expression ')' { $$ = ast_expr_call(data, $1, $3); }
+	| expression ',' primary_expression { $$ = BINARY(EXPR_LIST, $1, NULL, $3); }
+	| expression '.' primary_expression { $$ = BINARY(EXPR_MEMBER, $1, NULL, $3); }
 	| primary_expression                { $$ = $1; }
 	;
 
 primary_expression
 	: primary_expression logical_op relational_expression
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
+		{ $$ = BINARY(EXPR_BINARY, $1, $2, $3); }
 	| relational_expression { $$ = $1; }
 	;
 
 relational_expression
 	: relational_expression relational_op additive_expression
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
+		{ $$ = BINARY(EXPR_BINARY, $1, $2, $3); }
 	| additive_expression { $$ = $1; }
 	;
 
 additive_expression 
 	: additive_expression additive_op multiplicative_expression
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
+		{ $$ = BINARY(EXPR_BINARY, $1, $2, $3); }
 	| multiplicative_expression { $$ = $1; }
 	;
 
 multiplicative_expression
 	: multiplicative_expression multiplicative_op unary_expression 
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
+		{ $$ = BINARY(EXPR_BINARY, $1, $2, $3); }
 	| unary_expression { $$ = $1; }
 	;
 
 unary_expression
-	: unary_op unary_expression { $$ = handle_unary_op($1, $2); }
+	: unary_op unary_expression { $$ = UNARY(EXPR_UNARY, $1, $2); }
 	| terminal { $$ = $1; }
 	| literal  { $$ = $1; }
 	;
@@ -273,36 +342,14 @@ unary_expression
 /*======================================================================================*/
 
 identifier
-	: identifier '.' primary_expression2 { $$ = $1; b_catchar($$, '.'); b_concat($$, $3); b_free($3); }
+	: identifier '.' member_expression { $$ = BINARY(EXPR_MEMBER, $1, NULL, $3); }
 	| primary_expression
 	;
 
-primary_expression2
-	: primary_expression2 logical_op relational_expression2
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
-	| relational_expression2 { $$ = $1; }
-	;
-
-relational_expression2
-	: relational_expression2 relational_op additive_expression2
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
-	| additive_expression2 { $$ = $1; }
-	;
-
-additive_expression2
-	: additive_expression2 additive_op multiplicative_expression2
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
-	| multiplicative_expression2 { $$ = $1; }
-	;
-
-multiplicative_expression2
-	: multiplicative_expression2 multiplicative_op unary_expression2
-		{ $$ = $1; B_CONCAT($$, $2); B_CONCAT($$, $3); b_free($3); }
-	| unary_expression2 { $$ = $1; }
-	;
-
-unary_expression2
-	: unary_op unary_expression2 { $$ = handle_unary_op($1, $2); }
+/* A member is a name, a bracketed expression or a unary operator applied to
+ * one of those. A literal or a binary operator only goes inside brackets. */
+member_expression
+	: unary_op member_expression { $$ = UNARY(EXPR_UNARY, $1, $2); }
 	| terminal { $$ = $1; }
 	;
 
@@ -310,44 +357,45 @@ unary_expression2
 /* Tokens */
 
 terminal
-	: '(' expression ')' inexplicable_f  { $$ = $2; b_insert_char($$, 0, $1); b_catchar($$, $3); if ($4) b_catchar($$, 'f'); }
-	| '[' expression ']'  { $$ = $2; b_insert_char($$, 0, $1); b_catchar($$, $3); }
-	| '{' expression '}'  { $$ = $2; b_insert_char($$, 0, $1); b_catchar($$, $3); }
+	: '(' expression ')' inexplicable_f  { $$ = GROUP("(", $2, ($4) ? ")f" : ")"); }
+	| '[' expression ']'  { $$ = GROUP("[", $2, "]"); }
+	| '{' expression '}'  { $$ = GROUP("{", $2, "}"); }
 	| identifier_terminal { $$ = $1; }
-	| terminal '?'        { $$ = $1; b_catchar($$, '?'); }
+	| terminal '?'        { $$ = UNARY(EXPR_POSTFIX, "?", $1); }
 	;
 
 literal
-	: STRING_LITERAL     { $$ = $1; }
-	| TOK_FLOAT          { $$ = $1; }
-	| TOK_INTEGER        { $$ = $1; }
+	: STRING_LITERAL     { $$ = TEXT($1); }
+	| TOK_FLOAT          { $$ = TEXT($1); }
+	| TOK_INTEGER        { $$ = TEXT($1); }
 	| TOK_NULL           { $$ = NULL; }
-	| DISTANCE
-	| TIME_VAL
-	| TOK_EMPTY_ARRAY
+	| DISTANCE           { $$ = TEXT($1); }
+	| TIME_VAL           { $$ = TEXT($1); }
+	| TOK_EMPTY_ARRAY    { $$ = TEXT($1); }
 	;
 
 identifier_terminal
-	: IDENTIFIER
-	| TOK_CONST
-	| VARIABLE
-	| identifier_clash
+	: IDENTIFIER       { $$ = NAME($1); }
+	| TOK_CONST        { $$ = NAME($1); }
+	| VARIABLE         { $$ = NAME($1); }
+	| identifier_clash { $$ = NAME($1); }
 	;
 
 identifier_clash
 	: TOK_MIN
 	| TOK_MAX
-	| TOK_CHANCE { $$ = b_fromlit("chance"); }
-	| TOK_BREAK  { $$ = b_fromlit("break"); }
-	| TOK_RETURN { $$ = b_fromlit("return"); }
+	| TOK_CHANCE
+	| TOK_BREAK
+	| TOK_RETURN
 	; 
 
 inexplicable_f : 'f' { $$ = 1; } | %empty { $$ = 0; } ;
 
 builtin_function  : TOK_SQRT ;
-additive_op       : '+' | '-' ;
-unary_op          : '+' | '-' | '@' | '!' { $$ = '!'; } | TOK_TYPEOF ;
-multiplicative_op : '^' | '*' | '/' | '%' ;
+additive_op       : '+' { $$ = "+"; } | '-' { $$ = "-"; } ;
+unary_op          : '+' { $$ = "+"; } | '-' { $$ = "-"; } | '@' { $$ = "@"; }
+                  | '!' { $$ = "not "; } | TOK_TYPEOF { $$ = "typeof "; } ;
+multiplicative_op : '^' { $$ = "^"; } | '*' { $$ = "*"; } | '/' { $$ = "/"; } | '%' { $$ = "%"; } ;
 
 relational_op     : OP_EQ  { $$ = "=="; }  | OP_NE { $$ = "!="; }
                   | OP_LE  { $$ = "le"; }  | OP_GE { $$ = "ge"; }
@@ -359,35 +407,173 @@ logical_op        : OP_AND { $$ = "and"; } | OP_OR { $$ = "or"; } ;
 %%
 /*======================================================================================*/
 
-static void
-fix_line_comment(bstring *bstr)
+/* Token streams record this so they are never fed to a parser with different token numbers. */
+const int parser_ntokens = YYNTOKENS;
+
+/* Tokens come from the scanner unless a pre-lexed stream was loaded. */
+#undef yylex
+static int
+parser_lex(YYSTYPE *lval, YYLTYPE *lloc, void *scanner, ast_data *data)
+{
+        int tok;
+
+        if (data->tokens) {
+                tok       = token_stream_lex(lval, data->tokens);
+                lloc->off = data->tokens->off;
+        } else {
+                tok       = yylex(lval, scanner);
+                lloc->off = (uint32_t)((uchar *)yyget_text(scanner) - data->input->buf);
+        }
+        return tok;
+}
+
+/* Drop the indentation and the leading "//" of a comment on a line of its own. */
+static ast_slice
+fix_line_comment(const ast_data *data, ast_slice slice)
 {
-        unsigned i;
-        for (i = 0; i < bstr->slen; ++i)
-                if (!isspace(bstr->data[i]))
+        const uchar *str = AST_SLICE_PTR(data, slice);
+        uint32_t     i;
+        for (i = 0; i < slice.len; ++i)
+                if (!isspace(str[i]))
                         break;
         i += 2;
-        memmove(bstr->data, bstr->data + i, bstr->slen + 1 - i);
-        bstr->slen -= i - 1;
-        bstr->data[bstr->slen - 1] = ' ';
-        bstr->data[bstr->slen]     = '\0';
+        return (ast_slice){slice.off + i, slice.len - i};
+}
+
+#ifdef PARSER_PROFILE
+/*======================================================================================*/
+/* Profiling */
+
+struct profile_count {
+        uint64_t count;
+        uint64_t nsecs;
+};
+
+struct profile_row {
+        const char *name;
+        int         line;
+        uint64_t    count;
+        uint64_t    shifts;
+        uint64_t    nsecs;
+};
+
+/* Parts of a large input may be parsed on several threads at once. */
+#define PROFILE_ADD(VAR, N) __atomic_fetch_add(&(VAR), (N), __ATOMIC_RELAXED)
+
+static struct profile_count   reduce_counts[YYNRULES];
+static struct profile_count   lex_counts[YYNTOKENS];
+static uint64_t               shift_counts[YYNTOKENS];
+static thread_local uint64_t  reduce_start;
+
+static inline uint64_t
+profile_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/* Times the scanner (or token stream) for each token. Tokens pushed into a
+ * push parser were scanned elsewhere, so only their shifts are counted. */
+static int
+profile_lex(YYSTYPE *lval, YYLTYPE *lloc, void *scanner, ast_data *data)
+{
+        const uint64_t start = profile_now();
+        const int      tok   = parser_lex(lval, lloc, scanner, data);
+        const int      kind  = YYTRANSLATE(tok);
+
+        PROFILE_ADD(lex_counts[kind].count, 1);
+        PROFILE_ADD(lex_counts[kind].nsecs, profile_now() - start);
+        return tok;
+}
+
+static void
+profile_shift(const int kind)
+{
+        PROFILE_ADD(shift_counts[kind], 1);
+}
+
+static void
+profile_reduce_begin(UNUSED const int rule)
+{
+        reduce_start = profile_now();
+}
+
+/* Not reached when an action bails out with YYERROR or YYABORT. */
+static void
+profile_reduce_end(const int rule)
+{
+        PROFILE_ADD(reduce_counts[rule].count, 1);
+        PROFILE_ADD(reduce_counts[rule].nsecs, profile_now() - reduce_start);
+}
+
+static int
+compare_rows(const void *a, const void *b)
+{
+        const struct profile_row *x = a;
+        const struct profile_row *y = b;
+
+        if (x->nsecs != y->nsecs)
+                return (x->nsecs < y->nsecs) ? 1 : -1;
+        if (x->count != y->count)
+                return (x->count < y->count) ? 1 : -1;
+        return (x->line > y->line) - (x->line < y->line);
 }
 
-static bstring *
-handle_unary_op(const int op, bstring *s2)
+/*
+ * Writes the counts gathered so far, most expensive first: each grammar rule
+ * (by its left-hand side and its line in parser.y) with how often it was
+ * reduced and the time spent in its action, then each token type with how
+ * often it was scanned and shifted and the time spent scanning it.
+ */
+void
+parser_profile_report(FILE *fp)
 {
-	bstring *ret;
-	if (op == '!') {
-		ret = b_sprintf("not %s", s2);
-		b_free(s2); 
-	} else if (op == TOK_TYPEOF) {
-		ret = b_sprintf("typeof %s", s2);
-		b_free(s2); 
-	} else {
-		b_insert_char(s2, 0, op);
-		ret = s2; 
-	}
-	return ret;
+        struct profile_row rows[(YYNRULES > YYNTOKENS) ? YYNRULES : YYNTOKENS];
+        uint64_t           count = 0;
+        uint64_t           nsecs = 0;
+        unsigned           n     = 0;
+
+        /* Rule 0 is Bison's own $accept, which is never reduced. */
+        for (int r = 1; r < YYNRULES; ++r) {
+                const struct profile_count c = reduce_counts[r];
+                if (c.count == 0)
+                        continue;
+                rows[n++] = (struct profile_row){yytname[yyr1[r]], yyrline[r], c.count, 0, c.nsecs};
+                count    += c.count;
+                nsecs    += c.nsecs;
+        }
+        qsort(rows, n, sizeof rows[0], compare_rows);
+
+        fprintf(fp, "\nParser profile: %" PRIu64 " reductions in %.3f ms\n", count, (double)nsecs / 1e6);
+        fprintf(fp, "%12s %12s %9s %6s  %s\n", "reductions", "total ms", "ns each", "%time", "rule");
+        for (unsigned i = 0; i < n; ++i)
+                fprintf(fp, "%12" PRIu64 " %12.3f %9.1f %6.2f  %s (parser.y:%d)\n",
+                        rows[i].count, (double)rows[i].nsecs / 1e6,
+                        (double)rows[i].nsecs / (double)rows[i].count,
+                        nsecs ? 100.0 * (double)rows[i].nsecs / (double)nsecs : 0.0,
+                        rows[i].name, rows[i].line);
+
+        count = nsecs = n = 0;
+        for (int k = 0; k < YYNTOKENS; ++k) {
+                const struct profile_count c = lex_counts[k];
+                if (c.count == 0 && shift_counts[k] == 0)
+                        continue;
+                rows[n++] = (struct profile_row){yytname[k], 0, c.count, shift_counts[k], c.nsecs};
+                count    += c.count;
+                nsecs    += c.nsecs;
+        }
+        qsort(rows, n, sizeof rows[0], compare_rows);
+
+        fprintf(fp, "\nScanner profile: %" PRIu64 " tokens in %.3f ms\n", count, (double)nsecs / 1e6);
+        fprintf(fp, "%12s %12s %12s %9s %6s  %s\n", "scanned", "shifted", "total ms", "ns each", "%time", "token");
+        for (unsigned i = 0; i < n; ++i)
+                fprintf(fp, "%12" PRIu64 " %12" PRIu64 " %12.3f %9.1f %6.2f  %s\n",
+                        rows[i].count, rows[i].shifts, (double)rows[i].nsecs / 1e6,
+                        rows[i].count ? (double)rows[i].nsecs / (double)rows[i].count : 0.0,
+                        nsecs ? 100.0 * (double)rows[i].nsecs / (double)nsecs : 0.0,
+                        rows[i].name);
 }
+#endif /* PARSER_PROFILE */
 
 // vim: noexpandtab tw=0
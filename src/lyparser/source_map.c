@@ -0,0 +1,79 @@
+#include "Common.h"
+#include <talloc.h>
+
+#include "source_map.h"
+#include "util/scan.h"
+
+#define SOURCE_MAP_MAGIC "LYMAP 1"
+#define MAP_FLUSH_SIZE   65536
+
+static void cat_entry(struct source_map *map, uint32_t line, uint32_t column);
+
+/*======================================================================================*/
+
+struct source_map *
+source_map_open(const void *talloc_ctx, const char *fname, const char *in_name)
+{
+        struct source_map *map = talloc_zero(talloc_ctx, struct source_map);
+        map->fp        = safe_fopen(fname, "wb");
+        map->buf       = b_create(MAP_FLUSH_SIZE + 64);
+        map->prev_line = 1;
+
+        fprintf(map->fp, SOURCE_MAP_MAGIC " %s\n", (in_name) ? in_name : "-");
+        return map;
+}
+
+/*
+ * Adds an entry for each line in the output text [text, end) that was written
+ * for the node at `src'.
+ */
+void
+source_map_add(struct source_map *map, const ast_data *data, const uint32_t src, const uchar *text, const uchar *end)
+{
+        const unsigned nlines = (unsigned)scan_count(text, end, '\n');
+        if (nlines == 0)
+                return;
+
+        const struct ast_position pos = ast_input_locate(data->input, src);
+
+        cat_entry(map, pos.line, pos.column);
+        for (unsigned i = 1; i < nlines; ++i)
+                cat_entry(map, map->prev_line + 1, 1);
+
+        if (map->buf->slen >= MAP_FLUSH_SIZE) {
+                b_fwrite(map->fp, map->buf);
+                map->buf->slen = 0;
+        }
+}
+
+/* Writes out whatever is left and closes the file. Returns 0 on success. */
+int
+source_map_close(struct source_map *map)
+{
+        if (!map)
+                return 0;
+
+        b_fwrite(map->fp, map->buf);
+        bool ok = !ferror(map->fp);
+        if (fclose(map->fp) != 0)
+                ok = false;
+        if (!ok)
+                warn("Failed to write source map");
+
+        b_destroy(map->buf);
+        talloc_free(map);
+        return (ok) ? 0 : (-1);
+}
+
+/*======================================================================================*/
+
+static void
+cat_entry(struct source_map *map, const uint32_t line, const uint32_t column)
+{
+        char buf[32];
+        int  len = snprintf(buf, sizeof buf, "%" PRId64 " %" PRIu32 "\n",
+                            (int64_t)line - (int64_t)map->prev_line, column);
+
+        b_catblk(map->buf, buf, len);
+        map->prev_line = line;
+}
@@ -0,0 +1,42 @@
+#ifndef SOURCE_MAP_H_
+#define SOURCE_MAP_H_
+
+#include "Common.h"
+#include "ast.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * A side-car file that maps each line of the XML output back to the script
+ * it was written from, so a line number reported against the XML can be
+ * traced to its source. It is a text file: a header line
+ *
+ *     LYMAP 1 <input name>
+ *
+ * followed by one line per line of XML, in order, holding the difference
+ * between its source line and that of the previous entry (the first counts
+ * from line 1) and its 1-based source column in characters:
+ *
+ *     <line delta> <column>
+ *
+ * XML line N is described by line N + 1 of the map. Each line maps to the
+ * start of the statement, block or comment it came from; the closing tag of a
+ * block maps to its opening brace, and further lines written for one node (a
+ * comment spanning lines) to the lines that follow it, at column 1. Positions
+ * are found with ast_input_locate(), so nodes may come in any order.
+ */
+struct source_map {
+        FILE     *fp;
+        bstring  *buf;
+        uint32_t  prev_line; /* Source line of the last entry written */
+};
+
+extern struct source_map *source_map_open (const void *talloc_ctx, const char *fname, const char *in_name);
+extern void               source_map_add  (struct source_map *map, const ast_data *data, uint32_t src,
+                                           const uchar *text, const uchar *end);
+extern int                source_map_close(struct source_map *map);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* source_map.h */
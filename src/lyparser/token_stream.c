@@ -0,0 +1,232 @@
+#include "Common.h"
+
+#include "token_stream.h"
+#include "lexer.h"
+
+enum token_value_kind { TV_NONE, TV_SELF, TV_SLICE };
+
+static enum token_value_kind token_value_kind(int tok);
+static void                  put_uleb(bstring *out, uint64_t val);
+static bool                  get_uleb(struct token_stream *ts, uint64_t *val);
+
+#define ZIGZAG(N)   (((uint64_t)(N) << 1) ^ (uint64_t)((int64_t)(N) >> 63))
+#define UNZIGZAG(N) ((int64_t)((N) >> 1) ^ -(int64_t)((N) & 1))
+
+/*======================================================================================*/
+
+/*
+ * Scans the whole input and writes it out as a token stream without parsing
+ * it. Returns 0 on success, and the number of tokens written in `ntokens'.
+ */
+int
+token_stream_write(ast_data *data, FILE *fp, uint64_t *ntokens)
+{
+        yyscan_t        scanner;
+        YY_BUFFER_STATE buf;
+        YYSTYPE         lval;
+        bstring        *out      = b_create(data->input->len);
+        uint32_t        prev_off = 0;
+        int             lineno   = 1;
+        int             tok;
+
+        struct token_stream_header hdr = {
+                .magic           = TOKEN_STREAM_MAGIC,
+                .version         = TOKEN_STREAM_VERSION,
+                .ntokens_grammar = (uint16_t)parser_ntokens,
+                .text_len        = data->input->len,
+        };
+
+        yylex_init_extra(data, &scanner);
+        buf = yy_scan_buffer((char *)data->input->buf, data->input->len + AST_INPUT_PAD, scanner);
+
+        while ((tok = yylex(&lval, scanner)) != TOK_EOF) {
+                const int      line = yyget_lineno(scanner);
+                const uint32_t off  = (uint32_t)((uchar *)yyget_text(scanner) - data->input->buf);
+                put_uleb(out, (uint64_t)tok);
+                put_uleb(out, (uint64_t)(line - lineno));
+                put_uleb(out, off - prev_off);
+                lineno   = line;
+                prev_off = off;
+
+                if (token_value_kind(tok) == TV_SLICE) {
+                        put_uleb(out, ZIGZAG((int64_t)lval.SLICE.off - (int64_t)off));
+                        put_uleb(out, lval.SLICE.len);
+                }
+                ++hdr.ntokens;
+        }
+
+        yy_delete_buffer(buf, scanner);
+        yylex_destroy(scanner);
+
+        hdr.tokens_len = out->slen;
+        static const uchar pad[AST_INPUT_PAD] = {0};
+        const bool ok  = fwrite(&hdr, sizeof hdr, 1, fp) == 1 &&
+                         fwrite(data->input->buf, 1, data->input->len, fp) == data->input->len &&
+                         fwrite(pad, 1, sizeof pad, fp) == sizeof pad &&
+                         fwrite(out->data, 1, out->slen, fp) == out->slen;
+        b_destroy(out);
+
+        if (!ok) {
+                warn("Failed to write token stream");
+                return (-1);
+        }
+        if (ntokens)
+                *ntokens = hdr.ntokens;
+        return 0;
+}
+
+/*
+ * Called on a freshly read token stream file. The input is pointed at the
+ * embedded text, so slices resolve against it, and the tokens are set up for
+ * token_stream_lex().
+ */
+bool
+token_stream_attach(ast_data *data)
+{
+        struct ast_input           *input = data->input;
+        struct token_stream_header  hdr;
+
+        if (input->len < sizeof hdr) {
+                warnx("Error: Token stream is truncated");
+                return false;
+        }
+        memcpy(&hdr, input->buf, sizeof hdr);
+
+        if (memcmp(hdr.magic, TOKEN_STREAM_MAGIC, sizeof hdr.magic) != 0 || hdr.version != TOKEN_STREAM_VERSION) {
+                warnx("Error: Not a token stream, or one from an incompatible version");
+                return false;
+        }
+        if (hdr.ntokens_grammar != parser_ntokens) {
+                warnx("Error: Token stream was written for a different grammar (%u tokens, expected %d)",
+                      hdr.ntokens_grammar, parser_ntokens);
+                return false;
+        }
+        const size_t avail = input->len - sizeof hdr;
+        if (hdr.text_len > UINT32_MAX || hdr.text_len + AST_INPUT_PAD > avail ||
+            hdr.tokens_len != avail - hdr.text_len - AST_INPUT_PAD) {
+                warnx("Error: Token stream is truncated or corrupt");
+                return false;
+        }
+
+        struct token_stream *ts = talloc_zero(data, struct token_stream);
+        input->buf  += sizeof hdr;
+        input->len   = hdr.text_len;
+        ts->cur      = input->buf + hdr.text_len + AST_INPUT_PAD;
+        ts->end      = ts->cur + hdr.tokens_len;
+        ts->text_len = (uint32_t)hdr.text_len;
+        ts->lineno   = 1;
+        ts->ntokens  = hdr.ntokens;
+        data->tokens = ts;
+        return true;
+}
+
+/*
+ * Stands in for yylex() when the parser is fed a token stream. A malformed
+ * stream is treated as ending early, which the parser then reports.
+ */
+int
+token_stream_lex(YYSTYPE *lval, struct token_stream *ts)
+{
+        uint64_t tok, delta, skip;
+
+        if (ts->cur >= ts->end) {
+                ts->off = ts->text_len;
+                return TOK_EOF;
+        }
+        if (!get_uleb(ts, &tok) || !get_uleb(ts, &delta) || !get_uleb(ts, &skip) ||
+            skip > ts->text_len - ts->off)
+                goto corrupt;
+        ts->lineno += (uint32_t)delta;
+        ts->off    += (uint32_t)skip;
+
+        switch (token_value_kind((int)tok)) {
+        case TV_SLICE: {
+                uint64_t dist, len;
+                if (!get_uleb(ts, &dist) || !get_uleb(ts, &len))
+                        goto corrupt;
+                const int64_t off = (int64_t)ts->off + UNZIGZAG(dist);
+                if (off < 0 || len > ts->text_len || (uint64_t)off > ts->text_len - len)
+                        goto corrupt;
+                lval->SLICE = (ast_slice){(uint32_t)off, (uint32_t)len};
+                break;
+        }
+        case TV_SELF:
+                lval->TOK_VAL = (int)tok;
+                break;
+        default:
+                lval->TOK_CSTR = NULL;
+                break;
+        }
+
+        return (int)tok;
+
+corrupt:
+        warnx("Error: Token stream is corrupt near line %u", ts->lineno);
+        ts->cur = ts->end;
+        ts->off = ts->text_len;
+        return TOK_EOF;
+}
+
+/*======================================================================================*/
+
+/*
+ * Which tokens carry a value is fixed by the grammar, so it isn't stored. This
+ * has to agree with the %token declarations in parser.y and with what the
+ * scanner actually sets.
+ */
+static enum token_value_kind
+token_value_kind(const int tok)
+{
+        if (tok < 256)
+                return TV_SELF;
+
+        switch (tok) {
+        case TOK_TYPEOF:
+                return TV_SELF;
+        case TOK_BREAK:   case TOK_CHANCE:  case TOK_RETURN:
+        case TOK_CONST:   case TOK_SQRT:    case TOK_MAX:     case TOK_MIN:
+        case VARIABLE:    case IDENTIFIER:  case XML_IDENTIFIER:
+        case TOK_INTEGER: case TOK_FLOAT:   case DISTANCE:    case TIME_VAL:
+        case STRING_LITERAL: case STRING_UNIMPL: case TOK_EMPTY_ARRAY:
+        case LINE_COMMENT: case BARE_LINE_COMMENT: case BLOCK_COMMENT:
+                return TV_SLICE;
+        default:
+                return TV_NONE;
+        }
+}
+
+static void
+put_uleb(bstring *out, uint64_t val)
+{
+        uchar buf[10];
+        int   n = 0;
+
+        do {
+                buf[n] = val & 0x7F;
+                val  >>= 7;
+                if (val)
+                        buf[n] |= 0x80;
+                ++n;
+        } while (val);
+
+        b_catblk(out, buf, n);
+}
+
+static bool
+get_uleb(struct token_stream *ts, uint64_t *val)
+{
+        uint64_t ret   = 0;
+        unsigned shift = 0;
+
+        while (ts->cur < ts->end && shift < 64) {
+                const uchar byte = *ts->cur++;
+                ret |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                        *val = ret;
+                        return true;
+                }
+                shift += 7;
+        }
+
+        return false;
+}
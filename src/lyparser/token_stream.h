@@ -0,0 +1,57 @@
+#ifndef TOKEN_STREAM_H_
+#define TOKEN_STREAM_H_
+
+#include "Common.h"
+#include "ast.h"
+#include "parser.tab.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * A pre-lexed input file. The layout, in native byte order, is
+ *
+ *     struct token_stream_header
+ *     text[text_len], followed by AST_INPUT_PAD NUL bytes
+ *     tokens[tokens_len]
+ *
+ * `text' is the normalized source; token values that are slices point into it
+ * exactly as they would into a scanned file, so the parser can't tell the
+ * difference. Each token is a ULEB128 token number followed by the ULEB128
+ * line delta and the ULEB128 distance of its start from the start of the
+ * previous token, and for tokens that carry a slice, the zigzag encoded
+ * distance of the slice from the token's start followed by the ULEB128
+ * length. Character tokens carry themselves and everything else carries
+ * nothing. `ntokens_grammar' guards against feeding a stream to a
+ * parser built from a different grammar.
+ */
+struct token_stream_header {
+        char     magic[4];
+        uint16_t version;
+        uint16_t ntokens_grammar;
+        uint64_t text_len;
+        uint64_t tokens_len;
+        uint64_t ntokens;
+};
+
+#define TOKEN_STREAM_MAGIC   "LYTS"
+#define TOKEN_STREAM_VERSION 3
+
+struct token_stream {
+        const uchar *cur;
+        const uchar *end;
+        uint32_t     text_len;
+        uint32_t     off;      /* Where the last token read starts */
+        uint32_t     lineno;
+        uint64_t     ntokens;
+};
+
+extern const int parser_ntokens;
+
+extern int  token_stream_write (ast_data *data, FILE *fp, uint64_t *ntokens);
+extern bool token_stream_attach(ast_data *data);
+extern int  token_stream_lex   (YYSTYPE *lval, struct token_stream *ts);
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* token_stream.h */
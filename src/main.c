@@ -1,8 +1,68 @@
 #include "Common.h"
+#include "comp_main.h"
+#include <getopt.h>
+
+static noreturn void usage(const char *progname, int status);
 
 int
-main(UNUSED int argc, UNUSED char *argv[])
+main(int argc, char *argv[])
+{
+        struct recompile_options opts = {0};
+        int                      ch;
+
+        while ((ch = getopt(argc, argv, "bBchj:lm:NsSt")) != (-1)) {
+                switch (ch) {
+                case 'b': opts.image     = true; break;
+                case 'B': opts.image_in  = true; break;
+                case 'c': opts.count     = true; break;
+                case 'j': opts.jobs      = (unsigned)s_xatoi(optarg); break;
+                case 'l': opts.lex_only  = true; break;
+                case 'm': opts.map_fname = optarg; break;
+                case 'N': opts.json      = true; break;
+                case 's': opts.stats     = true; break;
+                case 'S': opts.stream    = true; break;
+                case 't': opts.tokens_in = true; break;
+                case 'h': usage(argv[0], 0);
+                default:  usage(argv[0], 1);
+                }
+        }
+
+        argc -= optind;
+        argv += optind;
+        if (argc > 2)
+                usage(argv[-optind], 1);
+
+        opts.in_fname  = (argc > 0 && strcmp(argv[0], "-") != 0) ? argv[0] : NULL;
+        opts.out_fname = (argc > 1) ? argv[1] : NULL;
+
+        return recompile_main(&opts);
+}
+
+static noreturn void
+usage(const char *progname, const int status)
 {
-        printf("Hello, world!\n");
-        return 0;
+        fprintf((status) ? stderr : stdout,
+                "Usage: %s [-bBchlNsSt] [-j jobs] [-m map] [input|-] [output|-]\n"
+                "  -l  Only run the lexer and write a binary token stream\n"
+                "  -t  Read a token stream written by -l instead of source\n"
+                "  -b  Write the parsed tree as a binary image that other tools can map\n"
+                "      and read in place, instead of XML\n"
+                "  -B  Read an image written by -b instead of source, and write it out as\n"
+                "      XML, or JSON with -N\n"
+                "  -c  Only count the statements of each type, in one pass that doesn't keep\n"
+                "      the tree; syntax errors are counted as NODE_ERROR\n"
+                "  -j  Parse a large file on this many threads\n"
+                "  -m  Also write a map from each line of the XML output to the source\n"
+                "      line it came from to this file\n"
+                "  -N  Write the tree as newline delimited JSON, one object per node, instead\n"
+                "      of XML\n"
+                "  -s  Report lexing, parsing and writing time and throughput on stderr\n"
+                "  -S  Write out and free each statement as soon as it is parsed, keeping\n"
+                "      memory use flat; output stops at the first syntax error, leaving\n"
+                "      what was written before it. Input from a pipe or socket is parsed\n"
+                "      and written out a statement at a time as it arrives.\n"
+                "  -h  Show this help\n"
+                "Only one of -l, -b, -c and -N can be given. -m only goes with XML output.\n",
+                progname);
+        exit(status);
 }
@@ -0,0 +1,95 @@
+#include "Common.h"
+
+#include "util/arena.h"
+
+/*======================================================================================*/
+
+struct arena *
+arena_create(const size_t block_size)
+{
+        struct arena *arena = xcalloc(1, sizeof(struct arena));
+        arena->block_size   = (block_size) ? block_size : ARENA_DEFAULT_SIZE;
+        return arena;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+        if (!arena)
+                return;
+        arena_reset(arena);
+        for (struct arena_block *block = arena->spare, *next; block; block = next) {
+                next = block->next;
+                xfree(block);
+        }
+        xfree(arena);
+}
+
+/* Frees everything allocated so far. The blocks are kept for reuse. */
+void
+arena_reset(struct arena *arena)
+{
+        struct arena_block *block = arena->head;
+        while (block) {
+                struct arena_block *next = block->next;
+                block->used  = 0;
+                block->next  = arena->spare;
+                arena->spare = block;
+                block        = next;
+        }
+        arena->head = NULL;
+}
+
+/*
+ * Hands everything allocated from `from' over to `arena', leaving `from'
+ * empty. Nothing moves, so pointers into it stay valid. The block `arena' is
+ * filling stays in front.
+ */
+void
+arena_merge(struct arena *arena, struct arena *from)
+{
+        struct arena_block **tail;
+
+        if (from->head) {
+                if (!arena->head) {
+                        arena->head = from->head;
+                } else {
+                        for (tail = &arena->head->next; *tail; tail = &(*tail)->next)
+                                ;
+                        *tail = from->head;
+                }
+        }
+        if (from->spare) {
+                for (tail = &from->spare; *tail; tail = &(*tail)->next)
+                        ;
+                *tail        = arena->spare;
+                arena->spare = from->spare;
+        }
+
+        from->head  = NULL;
+        from->spare = NULL;
+}
+
+/*
+ * Called by arena_alloc() when the current block is full. A spare block is
+ * used if the first one is big enough, otherwise a new one is made. Requests
+ * larger than the block size get a block of their own.
+ */
+void *
+arena_alloc_slow(struct arena *arena, const size_t size)
+{
+        struct arena_block *block = arena->spare;
+
+        if (block && block->size >= size) {
+                arena->spare = block->next;
+        } else {
+                const size_t bsize = MAX(arena->block_size, size);
+                block              = xmalloc(offsetof(struct arena_block, data) + bsize);
+                block->size        = bsize;
+        }
+
+        block->used = size;
+        block->next = arena->head;
+        arena->head = block;
+        return block->data;
+}
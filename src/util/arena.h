@@ -0,0 +1,66 @@
+#ifndef SRC_UTIL_ARENA_H_
+#define SRC_UTIL_ARENA_H_
+
+#include "Common.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * A bump allocator for many small objects that all die together. Memory is
+ * taken from large blocks by advancing a pointer, with no per-object header,
+ * and nothing is freed individually: arena_reset() releases everything at once
+ * but keeps the blocks to be filled again, and arena_destroy() gives them back
+ * to the system. An arena is not locked and belongs to one thread at a time.
+ */
+struct arena_block {
+        struct arena_block *next;
+        size_t              size;
+        size_t              used;
+        _Alignas(max_align_t) uchar data[];
+};
+
+struct arena {
+        struct arena_block *head;  /* Block being filled; the full ones follow it */
+        struct arena_block *spare; /* Blocks kept by arena_reset() */
+        size_t              block_size;
+};
+
+/* What goes in an arena is built of pointers and integers, so nothing needs
+ * more alignment than they do, and rounding every object up to that of
+ * max_align_t would only pad them. */
+#define ARENA_ALIGN        (_Alignof(uint64_t) > _Alignof(void *) ? _Alignof(uint64_t) : _Alignof(void *))
+#define ARENA_DEFAULT_SIZE (64 * 1024)
+
+extern struct arena *arena_create (size_t block_size) __aWUR;
+extern void          arena_destroy(struct arena *arena);
+extern void          arena_reset  (struct arena *arena);
+extern void          arena_merge  (struct arena *arena, struct arena *from);
+extern void         *arena_alloc_slow(struct arena *arena, size_t size) __aWUR;
+
+/* Returns `size' bytes of uninitialized memory. */
+static inline void *
+arena_alloc(struct arena *arena, size_t size)
+{
+        struct arena_block *block = arena->head;
+        size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+        if (!block || block->size - block->used < size)
+                return arena_alloc_slow(arena, size);
+        void *ret    = block->data + block->used;
+        block->used += size;
+        return ret;
+}
+
+static inline void *
+arena_zalloc(struct arena *arena, const size_t size)
+{
+        return memset(arena_alloc(arena, size), 0, size);
+}
+
+#define arena_new(ARENA, TYPE)  ((TYPE *)arena_alloc((ARENA), sizeof(TYPE)))
+#define arena_znew(ARENA, TYPE) ((TYPE *)arena_zalloc((ARENA), sizeof(TYPE)))
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* arena.h */
@@ -0,0 +1,129 @@
+#include "Common.h"
+
+#include "util/intern.h"
+#include <limits.h>
+
+/*
+ * The top bits of the hash pick the shard and the bottom bits pick the bucket
+ * within it, so the two never correlate.
+ */
+#define SHARD_BITS      6
+#define NUM_SHARDS      (1U << SHARD_BITS)
+#define SHARD_OF(HASH)  ((HASH) >> (32 - SHARD_BITS))
+#define MAX_QTY         (UINT32_MAX >> 1)
+#define INITIAL_BUCKETS 64
+
+struct shard {
+        pthread_mutex_t   lock;
+        interned_string **buckets;
+        uint32_t          nbuckets; /* Always a power of 2 */
+        uint32_t          qty;
+} __attribute__((__aligned__(64)));
+
+static struct shard shards[NUM_SHARDS] = {
+        [0 ... NUM_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static interned_string *shard_find  (const struct shard *shard, const void *buf, size_t len, uint32_t hash);
+static interned_string *shard_insert(struct shard *shard, const void *buf, size_t len, uint32_t hash);
+static void             shard_grow  (struct shard *shard);
+
+/*======================================================================================*/
+
+/* FNV-1a, with a final avalanche so the top bits are usable for the shard. */
+uint32_t
+intern_hash(const void *buf, const size_t len)
+{
+        const uchar *str  = buf;
+        uint32_t     hash = UINT32_C(2166136261);
+
+        for (size_t i = 0; i < len; ++i) {
+                hash ^= str[i];
+                hash *= UINT32_C(16777619);
+        }
+
+        hash ^= hash >> 16;
+        hash *= UINT32_C(0x85EBCA6B);
+        hash ^= hash >> 13;
+        hash *= UINT32_C(0xC2B2AE35);
+        hash ^= hash >> 16;
+        return hash;
+}
+
+const interned_string *
+intern_blk(const void *buf, const size_t len)
+{
+        const uint32_t   hash  = intern_hash(buf, len);
+        struct shard    *shard = &shards[SHARD_OF(hash)];
+        interned_string *ent;
+
+        pthread_mutex_lock(&shard->lock);
+        ent = shard_find(shard, buf, len, hash);
+        if (!ent)
+                ent = shard_insert(shard, buf, len, hash);
+        pthread_mutex_unlock(&shard->lock);
+
+        return ent;
+}
+
+/*======================================================================================*/
+
+static interned_string *
+shard_find(const struct shard *shard, const void *buf, const size_t len, const uint32_t hash)
+{
+        if (shard->nbuckets == 0)
+                return NULL;
+
+        for (interned_string *ent = shard->buckets[hash & (shard->nbuckets - 1)]; ent; ent = ent->next)
+                if (ent->hash == hash && ent->str.slen == len && memcmp(ent->name, buf, len) == 0)
+                        return ent;
+
+        return NULL;
+}
+
+static interned_string *
+shard_insert(struct shard *shard, const void *buf, const size_t len, const uint32_t hash)
+{
+        if (len >= UINT_MAX)
+                errx(1, "Attempt to intern a string of %zu bytes", len);
+        if (shard->qty >= MAX_QTY)
+                errx(1, "String intern table is full");
+        if (shard->qty >= shard->nbuckets)
+                shard_grow(shard);
+
+        interned_string *ent = xmalloc(offsetof(interned_string, name) + len + 1);
+        memcpy(ent->name, buf, len);
+        ent->name[len] = '\0';
+
+        ent->str  = (bstring){.slen = len, .mlen = len + 1, .data = ent->name, .flags = 0};
+        ent->hash = hash;
+
+        interned_string **bucket = &shard->buckets[hash & (shard->nbuckets - 1)];
+        ent->next                = *bucket;
+        *bucket                  = ent;
+        ++shard->qty;
+
+        return ent;
+}
+
+static void
+shard_grow(struct shard *shard)
+{
+        const uint32_t    nbuckets = (shard->nbuckets) ? shard->nbuckets * 2 : INITIAL_BUCKETS;
+        interned_string **buckets  = xcalloc(nbuckets, sizeof(interned_string *));
+
+        for (uint32_t i = 0; i < shard->nbuckets; ++i) {
+                interned_string *ent = shard->buckets[i];
+                while (ent) {
+                        interned_string *next = ent->next;
+                        interned_string **dst = &buckets[ent->hash & (nbuckets - 1)];
+                        ent->next             = *dst;
+                        *dst                  = ent;
+                        ent                   = next;
+                }
+        }
+
+        xfree(shard->buckets);
+        shard->buckets  = buckets;
+        shard->nbuckets = nbuckets;
+}
@@ -0,0 +1,33 @@
+#ifndef SRC_UTIL_INTERN_H_
+#define SRC_UTIL_INTERN_H_
+
+#include "Common.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Process wide table of unique strings. Every distinct string is stored exactly
+ * once and never freed, so the returned pointers stay valid for the life of
+ * the program and two interned strings are equal iff the pointers are equal.
+ * The table is split into independently locked shards and may be used from
+ * any number of threads at once.
+ *
+ * `str' is a read only bstring (no write or free flags set) that can be
+ * passed anywhere a `const bstring *' is expected; b_free() leaves it alone.
+ */
+typedef struct interned_string {
+        bstring                 str;
+        uint32_t                hash;
+        struct interned_string *next;
+        uchar                   name[];
+} interned_string;
+
+#define intern_cstr(CSTR_) intern_blk((CSTR_), strlen(CSTR_))
+
+extern const interned_string *intern_blk (const void *buf, size_t len) __aWUR;
+extern uint32_t               intern_hash(const void *buf, size_t len) __aWUR;
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* intern.h */
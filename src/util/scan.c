@@ -0,0 +1,314 @@
+#include "Common.h"
+
+#include "util/scan.h"
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#  define SCAN_X86 1
+#  include <immintrin.h>
+#endif
+
+static const uchar *skip2_scalar       (const uchar *p, const uchar *end, uchar a, uchar b);
+static const uchar *find_scalar        (const uchar *p, const uchar *end, uchar c);
+static const uchar *find_pair_scalar   (const uchar *p, const uchar *end, uchar c0, uchar c1);
+static size_t       count_scalar       (const uchar *p, const uchar *end, uchar c);
+static const uchar *find_special_scalar(const uchar *p, const uchar *end, uchar c);
+
+struct scan_kernels scan_kernels = {
+        skip2_scalar, find_scalar, find_pair_scalar, count_scalar, find_special_scalar, "scalar"
+};
+
+/*======================================================================================*/
+/* Scalar */
+
+static const uchar *
+skip2_scalar(const uchar *p, const uchar *const end, const uchar a, const uchar b)
+{
+        while (p < end && (*p == a || *p == b))
+                ++p;
+        return p;
+}
+
+static const uchar *
+find_scalar(const uchar *p, const uchar *const end, const uchar c)
+{
+        for (; p < end; ++p)
+                if (*p == c)
+                        return p;
+        return NULL;
+}
+
+static const uchar *
+find_pair_scalar(const uchar *p, const uchar *const end, const uchar c0, const uchar c1)
+{
+        for (; p + 1 < end; ++p)
+                if (p[0] == c0 && p[1] == c1)
+                        return p;
+        return NULL;
+}
+
+static size_t
+count_scalar(const uchar *p, const uchar *const end, const uchar c)
+{
+        size_t n = 0;
+        for (; p < end; ++p)
+                n += (*p == c);
+        return n;
+}
+
+static const uchar *
+find_special_scalar(const uchar *p, const uchar *const end, const uchar c)
+{
+        while (p < end && *p != c && *p < 0x80)
+                ++p;
+        return p;
+}
+
+/*======================================================================================*/
+/* SSE2 */
+#ifdef SCAN_X86
+
+#define SSE2 __attribute__((__target__("sse2")))
+
+static SSE2 const uchar *
+skip2_sse2(const uchar *p, const uchar *const end, const uchar a, const uchar b)
+{
+        const __m128i va = _mm_set1_epi8((char)a);
+        const __m128i vb = _mm_set1_epi8((char)b);
+
+        for (; end - p >= 16; p += 16) {
+                const __m128i v    = _mm_loadu_si128((const __m128i *)p);
+                const unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+                if (mask != 0xFFFFU)
+                        return p + __builtin_ctz(~mask);
+        }
+
+        return skip2_scalar(p, end, a, b);
+}
+
+static SSE2 const uchar *
+find_sse2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m128i vc = _mm_set1_epi8((char)c);
+
+        for (; end - p >= 16; p += 16) {
+                const __m128i  v    = _mm_loadu_si128((const __m128i *)p);
+                const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_scalar(p, end, c);
+}
+
+/* Compares each byte against c0 and its successor against c1 in one pass. */
+static SSE2 const uchar *
+find_pair_sse2(const uchar *p, const uchar *const end, const uchar c0, const uchar c1)
+{
+        const __m128i v0 = _mm_set1_epi8((char)c0);
+        const __m128i v1 = _mm_set1_epi8((char)c1);
+
+        for (; end - p >= 17; p += 16) {
+                const __m128i  a    = _mm_loadu_si128((const __m128i *)p);
+                const __m128i  b    = _mm_loadu_si128((const __m128i *)(p + 1));
+                const unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, v0), _mm_cmpeq_epi8(b, v1)));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_pair_scalar(p, end, c0, c1);
+}
+
+static SSE2 size_t
+count_sse2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m128i vc = _mm_set1_epi8((char)c);
+        size_t        n  = 0;
+
+        for (; end - p >= 16; p += 16) {
+                const __m128i v = _mm_loadu_si128((const __m128i *)p);
+                n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)));
+        }
+
+        return n + count_scalar(p, end, c);
+}
+
+/* The sign bit of each byte is exactly the non-ASCII test, so movemask gives it for free. */
+static SSE2 const uchar *
+find_special_sse2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m128i vc = _mm_set1_epi8((char)c);
+
+        for (; end - p >= 16; p += 16) {
+                const __m128i  v    = _mm_loadu_si128((const __m128i *)p);
+                const unsigned mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, vc)));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_special_scalar(p, end, c);
+}
+
+#undef SSE2
+
+/*======================================================================================*/
+/* AVX2 */
+
+#define AVX2 __attribute__((__target__("avx2")))
+
+static AVX2 const uchar *
+skip2_avx2(const uchar *p, const uchar *const end, const uchar a, const uchar b)
+{
+        const __m256i va = _mm256_set1_epi8((char)a);
+        const __m256i vb = _mm256_set1_epi8((char)b);
+
+        for (; end - p >= 32; p += 32) {
+                const __m256i  v    = _mm256_loadu_si256((const __m256i *)p);
+                const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+                if (mask != UINT32_MAX)
+                        return p + __builtin_ctz(~mask);
+        }
+
+        return skip2_scalar(p, end, a, b);
+}
+
+static AVX2 const uchar *
+find_avx2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m256i vc = _mm256_set1_epi8((char)c);
+
+        for (; end - p >= 32; p += 32) {
+                const __m256i  v    = _mm256_loadu_si256((const __m256i *)p);
+                const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_scalar(p, end, c);
+}
+
+static AVX2 const uchar *
+find_pair_avx2(const uchar *p, const uchar *const end, const uchar c0, const uchar c1)
+{
+        const __m256i v0 = _mm256_set1_epi8((char)c0);
+        const __m256i v1 = _mm256_set1_epi8((char)c1);
+
+        for (; end - p >= 33; p += 32) {
+                const __m256i  a    = _mm256_loadu_si256((const __m256i *)p);
+                const __m256i  b    = _mm256_loadu_si256((const __m256i *)(p + 1));
+                const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, v0), _mm256_cmpeq_epi8(b, v1)));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_pair_scalar(p, end, c0, c1);
+}
+
+static AVX2 size_t
+count_avx2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m256i vc = _mm256_set1_epi8((char)c);
+        size_t        n  = 0;
+
+        for (; end - p >= 32; p += 32) {
+                const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+                n += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc)));
+        }
+
+        return n + count_scalar(p, end, c);
+}
+
+static AVX2 const uchar *
+find_special_avx2(const uchar *p, const uchar *const end, const uchar c)
+{
+        const __m256i vc = _mm256_set1_epi8((char)c);
+
+        for (; end - p >= 32; p += 32) {
+                const __m256i  v    = _mm256_loadu_si256((const __m256i *)p);
+                const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, vc)));
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+
+        return find_special_scalar(p, end, c);
+}
+
+#undef AVX2
+
+/*======================================================================================*/
+
+__attribute__((__constructor__)) static void
+scan_kernels_select(void)
+{
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+                scan_kernels = (struct scan_kernels){skip2_avx2, find_avx2, find_pair_avx2, count_avx2, find_special_avx2, "avx2"};
+        else if (__builtin_cpu_supports("sse2"))
+                scan_kernels = (struct scan_kernels){skip2_sse2, find_sse2, find_pair_sse2, count_sse2, find_special_sse2, "sse2"};
+}
+
+#endif /* SCAN_X86 */
+/*======================================================================================*/
+
+/*
+ * Finds the end of a quoted string the way the scanner's old string patterns
+ * matched it, e.g. \"(\\\"|[^\"])*\" for double quotes. `p' points just past
+ * the opening quote. A quote only ends the string if it is not preceded by a
+ * backslash. Since flex takes the longest match, an escaped quote can still
+ * end the string if no unescaped quote follows it before the end of the input.
+ * Returns the closing quote, or NULL if the string is unterminated.
+ */
+const uchar *
+scan_quoted(const uchar *p, const uchar *const end, const uchar quote)
+{
+        const uchar *const start = p;
+        const uchar       *last  = NULL;
+
+        while ((p = scan_find(p, end, quote))) {
+                if (p == start || p[-1] != '\\')
+                        return p;
+                last = p++;
+        }
+
+        return last;
+}
+
+/*
+ * Returns the length of the well formed UTF-8 sequence starting at `p', which
+ * must be a non-ASCII byte, or 0 if it is malformed. Overlong forms, UTF-16
+ * surrogates and anything above U+10FFFF are rejected.
+ */
+unsigned
+scan_utf8_sequence(const uchar *p, const uchar *const end)
+{
+        const size_t avail = end - p;
+        uchar        lo    = 0x80;
+        uchar        hi    = 0xBF;
+        unsigned     len;
+
+        if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+                len = 2;
+        } else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+                len = 3;
+                if (p[0] == 0xE0)
+                        lo = 0xA0;
+                else if (p[0] == 0xED)
+                        hi = 0x9F;
+        } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+                len = 4;
+                if (p[0] == 0xF0)
+                        lo = 0x90;
+                else if (p[0] == 0xF4)
+                        hi = 0x8F;
+        } else {
+                return 0;
+        }
+
+        if (avail < len || p[1] < lo || p[1] > hi)
+                return 0;
+        for (unsigned i = 2; i < len; ++i)
+                if ((p[i] & 0xC0) != 0x80)
+                        return 0;
+
+        return len;
+}
@@ -0,0 +1,43 @@
+#ifndef SRC_UTIL_SCAN_H_
+#define SRC_UTIL_SCAN_H_
+
+#include "Common.h"
+
+__BEGIN_DECLS
+/*======================================================================================*/
+
+/*
+ * Byte scanning kernels for the places where the scanner would otherwise walk
+ * long runs of uninteresting input one character at a time. Each takes the
+ * half-open range [p, end) and never reads outside it. On x86 the SSE2 or AVX2
+ * version is chosen once at startup from what the CPU supports; everywhere
+ * else, and for the last few bytes of any range, a plain loop is used.
+ */
+struct scan_kernels {
+        /* First byte that is neither `a' nor `b', or `end'. */
+        const uchar *(*skip2)(const uchar *p, const uchar *end, uchar a, uchar b);
+        /* First occurrence of `c', or NULL. */
+        const uchar *(*find)(const uchar *p, const uchar *end, uchar c);
+        /* First occurrence of `c0' immediately followed by `c1', or NULL. */
+        const uchar *(*find_pair)(const uchar *p, const uchar *end, uchar c0, uchar c1);
+        /* Number of occurrences of `c'. */
+        size_t (*count)(const uchar *p, const uchar *end, uchar c);
+        /* First byte that is either `c' or outside ASCII, or `end'. */
+        const uchar *(*find_special)(const uchar *p, const uchar *end, uchar c);
+        const char *name;
+};
+
+extern struct scan_kernels scan_kernels;
+
+#define scan_skip2(P, END, A, B)       (scan_kernels.skip2((P), (END), (A), (B)))
+#define scan_find(P, END, C)           (scan_kernels.find((P), (END), (C)))
+#define scan_find_pair(P, END, C0, C1) (scan_kernels.find_pair((P), (END), (C0), (C1)))
+#define scan_count(P, END, C)          (scan_kernels.count((P), (END), (C)))
+#define scan_find_special(P, END, C)   (scan_kernels.find_special((P), (END), (C)))
+
+extern const uchar *scan_quoted      (const uchar *p, const uchar *end, uchar quote) __aWUR;
+extern unsigned     scan_utf8_sequence(const uchar *p, const uchar *end) __aWUR;
+
+/*======================================================================================*/
+__END_DECLS
+#endif /* scan.h */
@@ -1,5 +1,8 @@
 #include "util.h"
 #include <sys/stat.h>
+#ifndef DOSISH
+#  include <sys/mman.h>
+#endif
 
 #define STARTSIZE 1024
 #define GUESS 100
@@ -253,6 +256,88 @@ ret_func_name__(const char *const function, const size_t size)
 }
 #endif
 
+/*============================================================================*/
+/* Whole-file input */
+
+/*
+ * Map the regular file `fd' privately and writably, followed by at least `pad'
+ * zero bytes. The file is laid over an anonymous reservation, so the padding
+ * exists even when the file size is an exact multiple of the page size. Pages
+ * are only copied if something writes to them. Returns NULL if `fd' is not a
+ * regular file or cannot be mapped; the caller should fall back to reading it.
+ */
+void *
+map_file_padded(const int fd, const size_t pad, size_t *len, size_t *maplen)
+{
+#ifdef DOSISH
+        return NULL;
+#else
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+                return NULL;
+
+        const size_t pgsz  = (size_t)sysconf(_SC_PAGESIZE);
+        const size_t flen  = (size_t)st.st_size;
+        const size_t total = (flen + pad + pgsz - 1) & ~(pgsz - 1);
+
+        uchar *base = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+                return NULL;
+        if (flen > 0) {
+                if (mmap(base, flen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+                        munmap(base, total);
+                        return NULL;
+                }
+                madvise(base, flen, MADV_SEQUENTIAL);
+        }
+
+        *len    = flen;
+        *maplen = total;
+        return base;
+#endif
+}
+
+void
+unmap_file(void *base, const size_t maplen)
+{
+#ifndef DOSISH
+        if (base && maplen)
+                munmap(base, maplen);
+#endif
+}
+
+/*
+ * Read everything from `fd' into a malloc'd buffer followed by `pad' zero
+ * bytes. Used for pipes, terminals and anything else that can't be mapped.
+ */
+void *
+read_fd_padded(const int fd, const size_t pad, size_t *len)
+{
+        size_t  mlen = 65536;
+        size_t  slen = 0;
+        uchar  *buf  = xmalloc(mlen);
+
+        for (;;) {
+                if (mlen - slen < pad + 4096)
+                        buf = xrealloc(buf, (mlen *= 2));
+
+                const ssize_t n = read(fd, buf + slen, mlen - slen - pad);
+                if (n == 0)
+                        break;
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        xfree(buf);
+                        return NULL;
+                }
+                slen += (size_t)n;
+        }
+
+        memset(buf + slen, 0, pad);
+        *len = slen;
+        return buf;
+}
+
 /*============================================================================*/
 /* List operations */
 
@@ -102,6 +102,10 @@ extern FILE *   safe_fopen_fmt(const char *fmt, const char *mode, ...) __aWUR __
 extern int      safe_open     (const char *filename, int flags, int mode) __aWUR;
 extern int      safe_open_fmt (const char *fmt, int flags, int mode, ...) __aWUR __aFMT(1, 4);
 
+extern void *   map_file_padded(int fd, size_t pad, size_t *len, size_t *maplen) __aWUR __aNNA;
+extern void     unmap_file     (void *base, size_t maplen);
+extern void *   read_fd_padded (int fd, size_t pad, size_t *len) __aWUR __aNNA;
+
 extern bstring *get_command_output(const char *command, char *const *const argv, bstring *input);
 #ifdef DOSISH
 extern bstring *_win32_get_command_output(char *argv, bstring *input);
@@ -0,0 +1,42 @@
+#!/bin/sh
+# A tree saved with -b and read back with -B must be written out exactly as
+# it would have been straight from the source, and an image from another
+# version, or one cut short, must be refused.
+set -u
+parser=$1
+data=$2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for fmt in "" -N; do
+        if ! "$parser" $fmt "$data/sample.txt" "$tmp/direct" ||
+           ! "$parser" -b "$data/sample.txt" "$tmp/tree.img" ||
+           ! "$parser" -B $fmt "$tmp/tree.img" "$tmp/image"
+        then
+                echo "image: a run with '$fmt' failed" >&2
+                exit 1
+        fi
+        if ! cmp -s "$tmp/direct" "$tmp/image"; then
+                echo "image: output read back from the image with '$fmt' differs" >&2
+                exit 1
+        fi
+done
+
+# The version follows the 4 byte magic.
+cp "$tmp/tree.img" "$tmp/version.img"
+printf '\377\377' | dd of="$tmp/version.img" bs=1 seek=4 conv=notrunc 2>/dev/null
+size=$(wc -c <"$tmp/tree.img")
+head -c $((size - 1)) "$tmp/tree.img" >"$tmp/short.img"
+
+for img in version short; do
+        if "$parser" -B "$tmp/$img.img" "$tmp/out" 2>"$tmp/err"; then
+                echo "image: the $img image was accepted" >&2
+                exit 1
+        fi
+        if ! grep -q 'not an AST image' "$tmp/err"; then
+                echo "image: the $img image was not refused as such:" >&2
+                cat "$tmp/err" >&2
+                exit 1
+        fi
+done
+exit 0
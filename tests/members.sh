@@ -0,0 +1,29 @@
+#!/bin/sh
+# The member of a name being assigned to is a name, a bracketed expression or
+# a unary operator applied to one. A literal or a binary operator is only
+# accepted inside brackets.
+set -u
+parser=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for st in 'let $a.$b = 1;' 'let $a.b.c = 1;' 'let $a.-$b = 1;' 'let $a.!$b = 1;' \
+          'let $a.$b? = 1;' 'let $a.($b + 1) = 1;' "let \$a.('key') = 1;" 'let $a.[$b] = 1;' \
+          "let \$x = \$a.'key';"
+do
+        printf '%s\n' "$st" >"$tmp/in.txt"
+        if ! "$parser" "$tmp/in.txt" "$tmp/out" 2>"$tmp/err"; then
+                echo "members: '$st' was refused:" >&2
+                cat "$tmp/err" >&2
+                exit 1
+        fi
+done
+
+for st in "let \$a.'key' = 1;" 'let $a.-1 = 1;' 'let $a.$b + 1 = 1;' 'let $a.$b && $c = 1;'; do
+        printf '%s\n' "$st" >"$tmp/in.txt"
+        if "$parser" "$tmp/in.txt" "$tmp/out" 2>"$tmp/err" || ! grep -q 'syntax error' "$tmp/err"; then
+                echo "members: '$st' was not a syntax error" >&2
+                exit 1
+        fi
+done
+exit 0
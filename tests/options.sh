@@ -0,0 +1,27 @@
+#!/bin/sh
+# Options that ask for conflicting kinds of output must be refused before
+# anything is read or written.
+set -u
+parser=$1
+data=$2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for opts in "-b -N" "-c -b" "-c -N" "-l -b" "-l -c" "-l -N" "-l -t" \
+            "-N -m $tmp/out.map" "-b -m $tmp/out.map" "-b -S" "-c -S"
+do
+        if "$parser" $opts "$data/two_errors.txt" "$tmp/out" 2>"$tmp/err"; then
+                echo "options: $opts was accepted" >&2
+                exit 1
+        fi
+        if ! grep -q 'Error:' "$tmp/err" || grep -q 'Parsing Error:' "$tmp/err"; then
+                echo "options: $opts was not refused up front:" >&2
+                cat "$tmp/err" >&2
+                exit 1
+        fi
+        if [ -e "$tmp/out" ] || [ -e "$tmp/out.map" ]; then
+                echo "options: $opts wrote output" >&2
+                exit 1
+        fi
+done
+exit 0
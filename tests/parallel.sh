@@ -0,0 +1,57 @@
+#!/bin/sh
+# Parsing on several threads must give exactly what parsing on one does. The
+# input is generated to be large enough to be split at all, and is full of
+# places where a careless split would go wrong: semicolons, braces and comment
+# markers inside strings and comments, strings and comments running over
+# several lines, escaped quotes, and blocks closed just before an else or
+# elsif or opened just after a statement.
+set -u
+parser=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+awk 'BEGIN {
+        for (i = 0; i < 4000; ++i) {
+                printf "let $a%d = $b * (%d + $c) - 1;\n", i, i
+                printf "if ($x == %d) {\n", i
+                printf "  debug '\''if (a) { b; } // not a comment'\'';\n"
+                printf "}\n"
+                printf "elsif ($x > %d) {\n", i
+                printf "  let $y = 2; // a comment with \"quotes\" and a brace }\n"
+                printf "}\n"
+                printf "else {\n"
+                printf "  let $w = 3;\n"
+                printf "}\n"
+                printf "/* a comment\n"
+                printf "   ending a statement; } on a line of its own\n"
+                printf "*/\n"
+                printf "debug '\''it\\'\''s\n}\n'\'' chance (50);\n"
+                printf "while ($i < %d) { let $i = $i + 1; }\n", i
+                printf "foo<a=\"x;}\">;\n"
+                printf "{\n"
+                printf "  let $z = '\''}\\n\"'\'';\n"
+                printf "}\n"
+        }
+}' >"$tmp/in.txt"
+
+if ! "$parser" "$tmp/in.txt" "$tmp/serial.xml"; then
+        echo "parallel: serial parse failed" >&2
+        exit 1
+fi
+for jobs in 2 3 4 7 16; do
+        if ! "$parser" -s -j "$jobs" "$tmp/in.txt" "$tmp/parallel.xml" 2>"$tmp/err"; then
+                echo "parallel: parse with -j $jobs failed:" >&2
+                cat "$tmp/err" >&2
+                exit 1
+        fi
+        # A part that fails to parse makes the whole input be parsed serially.
+        if ! grep -q 'parsed in parallel' "$tmp/err"; then
+                echo "parallel: -j $jobs fell back to parsing serially" >&2
+                exit 1
+        fi
+        if ! cmp -s "$tmp/serial.xml" "$tmp/parallel.xml"; then
+                echo "parallel: output with -j $jobs differs from the serial output" >&2
+                exit 1
+        fi
+done
+exit 0
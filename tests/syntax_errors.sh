@@ -0,0 +1,44 @@
+#!/bin/sh
+# Each broken statement must be reported exactly once and replaced by exactly
+# one error node, whether the error is followed by a ';' or a block, and the
+# output must not be written.
+set -u
+parser=$1
+data=$2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if "$parser" "$data/two_errors.txt" "$tmp/out.xml" 2>"$tmp/err"; then
+        echo "syntax_errors: parse of two_errors.txt succeeded" >&2
+        exit 1
+fi
+n=$(grep -c 'Parsing Error:' "$tmp/err")
+if [ "$n" -ne 2 ] || ! grep -q ': 2 syntax errors,' "$tmp/err"; then
+        echo "syntax_errors: expected 2 errors, got $n:" >&2
+        cat "$tmp/err" >&2
+        exit 1
+fi
+if [ -e "$tmp/out.xml" ]; then
+        echo "syntax_errors: output was written despite the errors" >&2
+        exit 1
+fi
+
+# Nor from a pipe, unless streaming was asked for.
+if cat "$data/two_errors.txt" | "$parser" - "$tmp/out.xml" 2>/dev/null; then
+        echo "syntax_errors: parse of piped two_errors.txt succeeded" >&2
+        exit 1
+fi
+if [ -e "$tmp/out.xml" ]; then
+        echo "syntax_errors: output was written from a pipe despite the errors" >&2
+        exit 1
+fi
+
+# Counting still writes its counts, and there is one error node per error.
+"$parser" -c "$data/two_errors.txt" "$tmp/counts" 2>/dev/null
+n=$(awk '$1 == "NODE_ERROR" { print $2 }' "$tmp/counts")
+if [ "$n" != 2 ]; then
+        echo "syntax_errors: expected 2 error nodes, got ${n:-none}:" >&2
+        cat "$tmp/counts" >&2
+        exit 1
+fi
+exit 0